@@ -0,0 +1,123 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator for search tree nodes.
+//
+// A tree allocates every node (and every node's child list) out of one
+// NodeArena, so creating a node is a pointer bump and throwing a whole tree
+// away is a single reset() instead of a recursive walk of `delete`s. Nothing
+// allocated here ever has its destructor run: objects placed in an arena must
+// not own memory outside of it.
+//
+// Arenas are not thread-safe unless set_shared(true) has been called, in
+// which case allocations are serialised with a spinlock. Prefer giving each
+// thread its own arena; sharing is for trees several threads grow at once.
+class NodeArena {
+public:
+  explicit NodeArena(size_t block_size = 1 << 20) : block_size(block_size) { }
+
+  NodeArena(const NodeArena &) = delete;
+  NodeArena &operator=(const NodeArena &) = delete;
+
+  void *allocate(size_t bytes, size_t align) {
+    if (shared) {
+      while (lock.test_and_set(std::memory_order_acquire)) { }
+      auto p = allocate_unlocked(bytes, align);
+      lock.clear(std::memory_order_release);
+      return p;
+    }
+    return allocate_unlocked(bytes, align);
+  }
+
+  template <class T, class... Args>
+  T *make(Args &&...args) {
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  void set_shared(bool shared) { this->shared = shared; }
+
+  // Forgets everything allocated so far. The blocks are kept around and
+  // reused by subsequent allocations, so this is O(1).
+  void reset() {
+    cur = 0;
+    if (blocks.empty()) {
+      ptr = end = nullptr;
+    } else {
+      ptr = blocks[0].data.get();
+      end = ptr + blocks[0].size;
+    }
+  }
+
+private:
+  struct Block {
+    std::unique_ptr<std::byte[]> data;
+    size_t size;
+  };
+
+  void *allocate_unlocked(size_t bytes, size_t align) {
+    auto p = (reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(uintptr_t)(align - 1);
+    if (ptr == nullptr || p + bytes > reinterpret_cast<uintptr_t>(end)) {
+      next_block(bytes + align);
+      p = (reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    ptr = reinterpret_cast<std::byte *>(p + bytes);
+    return reinterpret_cast<void *>(p);
+  }
+
+  void next_block(size_t min_size) {
+    if (ptr != nullptr) {
+      cur++;
+    }
+    // reuse a block left over from before the last reset if it is big enough
+    while (cur < blocks.size() && blocks[cur].size < min_size) {
+      cur++;
+    }
+    if (cur >= blocks.size()) {
+      auto size = std::max(block_size, min_size);
+      blocks.push_back(Block{std::make_unique<std::byte[]>(size), size});
+      cur = blocks.size() - 1;
+    }
+    ptr = blocks[cur].data.get();
+    end = ptr + blocks[cur].size;
+  }
+
+  size_t block_size;
+  std::vector<Block> blocks;
+  size_t cur = 0;
+  std::byte *ptr = nullptr;
+  std::byte *end = nullptr;
+  bool shared = false;
+  std::atomic_flag lock;
+};
+
+// std::allocator-compatible adaptor so standard containers living inside
+// arena-allocated objects take their storage from the same arena.
+// deallocate() is a no-op; the memory comes back on NodeArena::reset().
+template <class T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+
+  NodeArena *arena;
+
+  ArenaAllocator(NodeArena *arena) : arena(arena) { }
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) { }
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) { }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+};
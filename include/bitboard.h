@@ -0,0 +1,754 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+#include "thc.h"
+
+// A bitboard chess position for the search's hot path: magic (or, with BMI2,
+// PEXT) slider attacks, legal move generation from pin and check masks, and
+// make/unmake in place. thc stays in charge of I/O; positions are built from
+// thc::ChessRules or FEN and print as FEN, and moves convert to and from
+// thc::Move.
+//
+// Squares are numbered a1 = 0, b1 = 1, ..., h8 = 63. thc numbers them from
+// a8, so a square converts to thc's numbering (and back) with sq ^ 56.
+namespace bb {
+
+using Bitboard = uint64_t;
+
+enum Color : uint8_t { WHITE, BLACK };
+enum PieceType : uint8_t { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
+
+// A piece is type + 6 * color, so pieces run "PNBRQKpnbrqk" like the
+// network's input planes; squares without one hold NO_PIECE.
+constexpr int8_t NO_PIECE = -1;
+constexpr const char* piece_chars = "PNBRQKpnbrqk";
+
+constexpr int8_t make_piece(Color c, PieceType t) {
+  return t + 6 * c;
+}
+
+enum CastlingRights : uint8_t { WHITE_OO = 1, WHITE_OOO = 2, BLACK_OO = 4, BLACK_OOO = 8 };
+
+constexpr Bitboard bit(int sq) {
+  return 1ULL << sq;
+}
+
+inline int lsb(Bitboard b) {
+  return std::countr_zero(b);
+}
+
+inline int pop_lsb(Bitboard& b) {
+  int sq = lsb(b);
+  b &= b - 1;
+  return sq;
+}
+
+constexpr Bitboard rank_1 = 0xffULL;
+constexpr Bitboard rank_8 = rank_1 << 56;
+constexpr Bitboard file_a = 0x0101010101010101ULL;
+constexpr Bitboard file_h = file_a << 7;
+
+// 64-bit Zobrist keys: a position's key is the XOR of the keys of its
+// pieces on their squares, its castling rights, its en passant file and the
+// side to move, so a move updates it with a few XORs.
+class ZobristKeys {
+public:
+  uint64_t piece_square[12][64];
+  uint64_t castling[16]; // one per combination of CastlingRights
+  uint64_t en_passant[8]; // by file
+  uint64_t black_to_move;
+
+  ZobristKeys() {
+    // splitmix64 from a fixed seed, so keys are the same from run to run
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    auto random = [&seed]() {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    };
+    for (auto& squares : piece_square) {
+      for (auto& key : squares) {
+        key = random();
+      }
+    }
+    castling[0] = 0;
+    for (int rights = 1; rights < 16; rights++) {
+      castling[rights] = random();
+    }
+    for (auto& key : en_passant) {
+      key = random();
+    }
+    black_to_move = random();
+  }
+
+  ZobristKeys(const ZobristKeys&) = delete;
+  ZobristKeys& operator=(const ZobristKeys&) = delete;
+};
+
+inline const ZobristKeys zobrist;
+
+// from-square, to-square and one of the flags below in 16 bits
+class Move {
+public:
+  enum Flag : uint16_t {
+    QUIET = 0, DOUBLE_PUSH = 1, KING_CASTLE = 2, QUEEN_CASTLE = 3,
+    CAPTURE = 4, EN_PASSANT = 5,
+    PROMOTION = 8, // | 0..3 for knight, bishop, rook, queen; | CAPTURE when capturing
+  };
+
+  Move() = default;
+  Move(int from, int to, int flag) : data(from | to << 6 | flag << 12) { }
+
+  int from() const { return data & 63; }
+  int to() const { return (data >> 6) & 63; }
+  int flag() const { return data >> 12; }
+  bool is_capture() const { return flag() & CAPTURE; }
+  bool is_promotion() const { return flag() & PROMOTION; }
+  PieceType promotion() const { return (PieceType)(KNIGHT + (flag() & 3)); }
+
+  bool operator==(const Move& other) const { return data == other.data; }
+  bool operator!=(const Move& other) const { return data != other.data; }
+
+private:
+  uint16_t data = 0;
+};
+
+struct MoveList {
+  Move moves[256];
+  int count = 0;
+
+  void add(int from, int to, int flag) {
+    moves[count++] = Move(from, to, flag);
+  }
+  const Move* begin() const { return moves; }
+  const Move* end() const { return moves + count; }
+};
+
+// What make() needs to remember for unmake().
+struct Undo {
+  int8_t captured;
+  uint8_t castling;
+  int8_t en_passant;
+  uint8_t halfmove_clock;
+  uint64_t key;
+};
+
+// Attack tables, built once at startup.
+class AttackTables {
+public:
+  Bitboard pawn[2][64];
+  Bitboard knight[64];
+  Bitboard king[64];
+  Bitboard between[64][64]; // squares strictly between two aligned squares
+  Bitboard line[64][64];    // the whole line through two aligned squares
+
+  AttackTables() {
+    for (int sq = 0; sq < 64; sq++) {
+      pawn[WHITE][sq] = steps(sq, {{1, -1}, {1, 1}});
+      pawn[BLACK][sq] = steps(sq, {{-1, -1}, {-1, 1}});
+      knight[sq] = steps(sq, {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}});
+      king[sq] = steps(sq, {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}});
+    }
+    init_sliders(rook, rook_table, rook_dirs);
+    init_sliders(bishop, bishop_table, bishop_dirs);
+    for (int a = 0; a < 64; a++) {
+      for (int b = 0; b < 64; b++) {
+        between[a][b] = line[a][b] = 0;
+        for (auto dirs : {rook_dirs, bishop_dirs}) {
+          if (a != b && (ray_attacks(a, 0, dirs) & bit(b))) {
+            between[a][b] = ray_attacks(a, bit(b), dirs) & ray_attacks(b, bit(a), dirs);
+            line[a][b] = (ray_attacks(a, 0, dirs) & ray_attacks(b, 0, dirs)) | bit(a) | bit(b);
+          }
+        }
+      }
+    }
+  }
+
+  AttackTables(const AttackTables&) = delete;
+  AttackTables& operator=(const AttackTables&) = delete;
+
+  Bitboard rook_attacks(int sq, Bitboard occupied) const {
+    return rook[sq].attacks[rook[sq].index(occupied)];
+  }
+
+  Bitboard bishop_attacks(int sq, Bitboard occupied) const {
+    return bishop[sq].attacks[bishop[sq].index(occupied)];
+  }
+
+private:
+  using Dirs = const int (*)[2];
+  static constexpr int rook_dirs[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+  static constexpr int bishop_dirs[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+
+  struct Slider {
+    Bitboard mask;  // relevant occupancy: the rays without their last square
+    Bitboard magic;
+    int shift;
+    Bitboard* attacks;
+
+    unsigned index(Bitboard occupied) const {
+#if defined(__BMI2__)
+      return (unsigned)_pext_u64(occupied, mask);
+#else
+      return (unsigned)(((occupied & mask) * magic) >> shift);
+#endif
+    }
+  };
+
+  Slider rook[64];
+  Slider bishop[64];
+  Bitboard rook_table[0x19000];
+  Bitboard bishop_table[0x1480];
+
+  static bool on_board(int rank, int file) {
+    return rank >= 0 && rank < 8 && file >= 0 && file < 8;
+  }
+
+  // squares one (rank, file) step away from `sq`
+  static Bitboard steps(int sq, std::initializer_list<std::pair<int, int>> deltas) {
+    Bitboard b = 0;
+    for (auto [dr, df] : deltas) {
+      if (on_board(sq / 8 + dr, sq % 8 + df)) {
+        b |= bit(sq + 8 * dr + df);
+      }
+    }
+    return b;
+  }
+
+  // slider attacks by walking the rays; only used to fill the tables
+  static Bitboard ray_attacks(int sq, Bitboard occupied, Dirs dirs) {
+    Bitboard b = 0;
+    for (int d = 0; d < 4; d++) {
+      int rank = sq / 8 + dirs[d][0], file = sq % 8 + dirs[d][1];
+      for (; on_board(rank, file); rank += dirs[d][0], file += dirs[d][1]) {
+        b |= bit(8 * rank + file);
+        if (occupied & bit(8 * rank + file)) {
+          break;
+        }
+      }
+    }
+    return b;
+  }
+
+  // Fills each square's slice of `table` with the attacks for every subset of
+  // its mask. Without PEXT that needs a magic per square that maps those
+  // subsets to indices without two different attack sets colliding; they're
+  // found by trying sparse random numbers.
+  static void init_sliders(Slider* sliders, Bitboard* table, Dirs dirs) {
+    static Bitboard occupancy[4096], reference[4096];
+    static int epoch[4096];
+    std::fill(epoch, epoch + 4096, 0);
+    int attempt = 0;
+    // per-rank seeds that find all the magics quickly (Stockfish's)
+    static constexpr uint64_t seeds[8] = {728, 10316, 55013, 32803, 12281, 15100, 16645, 255};
+    uint64_t seed = 0;
+    auto random = [&seed]() {
+      seed ^= seed >> 12;
+      seed ^= seed << 25;
+      seed ^= seed >> 27;
+      return seed * 2685821657736338717ULL;
+    };
+    Bitboard* next = table;
+    for (int sq = 0; sq < 64; sq++) {
+      auto& s = sliders[sq];
+      Bitboard edges = ((rank_1 | rank_8) & ~(rank_1 << (8 * (sq / 8)))) | ((file_a | file_h) & ~(file_a << (sq % 8)));
+      s.mask = ray_attacks(sq, 0, dirs) & ~edges;
+      s.shift = 64 - std::popcount(s.mask);
+      s.attacks = next;
+      int size = 0;
+      Bitboard b = 0;
+      do {
+        occupancy[size] = b;
+        reference[size++] = ray_attacks(sq, b, dirs);
+        b = (b - s.mask) & s.mask;
+      } while (b);
+      next += size;
+#if defined(__BMI2__)
+      s.magic = 0;
+      for (int i = 0; i < size; i++) {
+        s.attacks[s.index(occupancy[i])] = reference[i];
+      }
+#else
+      seed = seeds[sq / 8];
+      for (int i = 0; i < size;) {
+        do {
+          s.magic = random() & random() & random();
+        } while (std::popcount((s.mask * s.magic) >> 56) < 6);
+        attempt++;
+        for (i = 0; i < size; i++) {
+          auto idx = s.index(occupancy[i]);
+          if (epoch[idx] < attempt) {
+            epoch[idx] = attempt;
+            s.attacks[idx] = reference[i];
+          } else if (s.attacks[idx] != reference[i]) {
+            break;
+          }
+        }
+      }
+#endif
+    }
+  }
+};
+
+inline const AttackTables attacks;
+
+class Position {
+public:
+  // the starting position
+  Position() : Position(thc::ChessRules()) { }
+
+  explicit Position(const thc::ChessRules& cr) {
+    std::fill(board, board + 64, NO_PIECE);
+    for (int sq = 0; sq < 64; sq++) {
+      auto piece = std::string_view(piece_chars).find(cr.squares[sq ^ 56]);
+      if (piece != std::string_view::npos) {
+        put(sq, (int8_t)piece);
+      }
+    }
+    side = cr.white ? WHITE : BLACK;
+    castling = (cr.wking_allowed() ? WHITE_OO : 0) | (cr.wqueen_allowed() ? WHITE_OOO : 0)
+             | (cr.bking_allowed() ? BLACK_OO : 0) | (cr.bqueen_allowed() ? BLACK_OOO : 0);
+    auto ep = cr.groomed_enpassant_target();
+    en_passant = ep == thc::SQUARE_INVALID ? -1 : ep ^ 56;
+    halfmove_clock = cr.half_move_clock;
+    fullmove_number = cr.full_move_count;
+    key ^= state_key();
+  }
+
+  // Throws std::runtime_error on malformed FEN.
+  static Position from_fen(const std::string& fen) {
+    thc::ChessRules cr;
+    if (!cr.Forsyth(fen.c_str())) {
+      throw std::runtime_error("[ERROR]: invalid FEN: " + fen);
+    }
+    return Position(cr);
+  }
+
+  std::string fen() const {
+    std::ostringstream out;
+    for (int rank = 7; rank >= 0; rank--) {
+      int empty = 0;
+      for (int file = 0; file < 8; file++) {
+        auto piece = board[8 * rank + file];
+        if (piece == NO_PIECE) {
+          empty++;
+          continue;
+        }
+        if (empty > 0) {
+          out << empty;
+          empty = 0;
+        }
+        out << piece_chars[piece];
+      }
+      if (empty > 0) {
+        out << empty;
+      }
+      if (rank > 0) {
+        out << '/';
+      }
+    }
+    out << (side == WHITE ? " w " : " b ");
+    if (castling == 0) {
+      out << '-';
+    }
+    for (auto [right, c] : {std::pair{WHITE_OO, 'K'}, {WHITE_OOO, 'Q'}, {BLACK_OO, 'k'}, {BLACK_OOO, 'q'}}) {
+      if (castling & right) {
+        out << c;
+      }
+    }
+    out << ' ';
+    if (en_passant < 0) {
+      out << '-';
+    } else {
+      out << (char)('a' + en_passant % 8) << (char)('1' + en_passant / 8);
+    }
+    out << ' ' << (int)halfmove_clock << ' ' << fullmove_number;
+    return out.str();
+  }
+
+  Color side_to_move() const { return side; }
+  int8_t piece_on(int sq) const { return board[sq]; }
+  Bitboard pieces(Color c) const { return by_color[c]; }
+  Bitboard pieces(Color c, PieceType t) const { return by_color[c] & by_type[t]; }
+  Bitboard occupied() const { return by_color[WHITE] | by_color[BLACK]; }
+  int halfmove() const { return halfmove_clock; }
+
+  // Zobrist key of the position (see ZobristKeys), kept up to date by
+  // make() and unmake(). Positions that are the same for the rules of chess
+  // (pieces, side to move, castling rights, a capturable en passant square)
+  // have the same key; move counters and history don't enter into it.
+  uint64_t hash() const { return key; }
+
+  // Positions compare by key: 8 bytes rather than the whole board, at the
+  // cost of a 2^-64 chance of calling two different positions the same.
+  bool operator==(const Position& other) const { return key == other.key; }
+  bool operator!=(const Position& other) const { return key != other.key; }
+
+  // pieces of either color attacking `sq` with `occupied` as the occupancy
+  Bitboard attackers_to(int sq, Bitboard occupied) const {
+    return (attacks.pawn[BLACK][sq] & pieces(WHITE, PAWN))
+         | (attacks.pawn[WHITE][sq] & pieces(BLACK, PAWN))
+         | (attacks.knight[sq] & by_type[KNIGHT])
+         | (attacks.king[sq] & by_type[KING])
+         | (attacks.bishop_attacks(sq, occupied) & (by_type[BISHOP] | by_type[QUEEN]))
+         | (attacks.rook_attacks(sq, occupied) & (by_type[ROOK] | by_type[QUEEN]));
+  }
+
+  bool in_check() const {
+    return attackers_to(king_square(side), occupied()) & by_color[side ^ 1];
+  }
+
+  void legal_moves(MoveList& list) const {
+    list.count = 0;
+    Color us = side, them = (Color)(side ^ 1);
+    Bitboard own = by_color[us], enemy = by_color[them], occ = own | enemy;
+    int ksq = king_square(us);
+    Bitboard checkers = attackers_to(ksq, occ) & enemy;
+
+    // the king steps anywhere not attacked once it has left its square
+    for (Bitboard b = attacks.king[ksq] & ~own; b;) {
+      int to = pop_lsb(b);
+      if (!(attackers_to(to, occ ^ bit(ksq)) & enemy)) {
+        list.add(ksq, to, board[to] == NO_PIECE ? Move::QUIET : Move::CAPTURE);
+      }
+    }
+    if (checkers & (checkers - 1)) {
+      return; // double check: only king moves
+    }
+    // in check, other pieces must capture the checker or block
+    Bitboard target = checkers ? attacks.between[ksq][lsb(checkers)] | checkers : ~0ULL;
+    Bitboard pinned = pinned_pieces(us, ksq);
+
+    auto add_piece_moves = [&](int from, Bitboard to_squares) {
+      if (pinned & bit(from)) {
+        to_squares &= attacks.line[ksq][from];
+      }
+      for (Bitboard b = to_squares & ~own & target; b;) {
+        int to = pop_lsb(b);
+        list.add(from, to, board[to] == NO_PIECE ? Move::QUIET : Move::CAPTURE);
+      }
+    };
+    for (Bitboard b = pieces(us, KNIGHT) & ~pinned; b;) {
+      int from = pop_lsb(b);
+      add_piece_moves(from, attacks.knight[from]);
+    }
+    for (Bitboard b = pieces(us, BISHOP) | pieces(us, QUEEN); b;) {
+      int from = pop_lsb(b);
+      add_piece_moves(from, attacks.bishop_attacks(from, occ));
+    }
+    for (Bitboard b = pieces(us, ROOK) | pieces(us, QUEEN); b;) {
+      int from = pop_lsb(b);
+      add_piece_moves(from, attacks.rook_attacks(from, occ));
+    }
+
+    int up = us == WHITE ? 8 : -8;
+    Bitboard last_rank = us == WHITE ? rank_8 : rank_1;
+    Bitboard start_rank = us == WHITE ? rank_1 << 8 : rank_8 >> 8;
+    auto add_pawn_move = [&](int from, int to, int flag) {
+      if (bit(to) & last_rank) {
+        for (int promotion = 3; promotion >= 0; promotion--) {
+          list.add(from, to, flag | Move::PROMOTION | promotion);
+        }
+      } else {
+        list.add(from, to, flag);
+      }
+    };
+    for (Bitboard b = pieces(us, PAWN); b;) {
+      int from = pop_lsb(b);
+      Bitboard allowed = target & ((pinned & bit(from)) ? attacks.line[ksq][from] : ~0ULL);
+      int one = from + up;
+      if (!(occ & bit(one))) {
+        if (allowed & bit(one)) {
+          add_pawn_move(from, one, Move::QUIET);
+        }
+        int two = one + up;
+        if ((start_rank & bit(from)) && !(occ & bit(two)) && (allowed & bit(two))) {
+          list.add(from, two, Move::DOUBLE_PUSH);
+        }
+      }
+      for (Bitboard caps = attacks.pawn[us][from] & enemy & allowed; caps;) {
+        add_pawn_move(from, pop_lsb(caps), Move::CAPTURE);
+      }
+      // en passant moves two pawns off their squares at once, which the pin
+      // and check masks don't capture; try it on the board instead
+      if (en_passant >= 0 && (attacks.pawn[us][from] & bit(en_passant))) {
+        int captured = en_passant - up;
+        Bitboard after = (occ ^ bit(from) ^ bit(captured)) | bit(en_passant);
+        Bitboard attackers = (attacks.rook_attacks(ksq, after) & (pieces(them, ROOK) | pieces(them, QUEEN)))
+                           | (attacks.bishop_attacks(ksq, after) & (pieces(them, BISHOP) | pieces(them, QUEEN)))
+                           | (attacks.knight[ksq] & pieces(them, KNIGHT))
+                           | (attacks.pawn[us][ksq] & pieces(them, PAWN) & ~bit(captured));
+        if (!attackers) {
+          list.add(from, en_passant, Move::EN_PASSANT);
+        }
+      }
+    }
+
+    if (!checkers) {
+      auto castle = [&](uint8_t right, int rook_from, int to, Bitboard must_be_empty, Bitboard must_be_safe) {
+        if (!(castling & right) || (occ & must_be_empty) || !(pieces(us, ROOK) & bit(rook_from))) {
+          return;
+        }
+        for (Bitboard b = must_be_safe; b;) {
+          if (attackers_to(pop_lsb(b), occ) & enemy) {
+            return;
+          }
+        }
+        list.add(ksq, to, to > ksq ? Move::KING_CASTLE : Move::QUEEN_CASTLE);
+      };
+      int base = us == WHITE ? 0 : 56; // a1 or a8
+      castle(us == WHITE ? WHITE_OO : BLACK_OO, base + 7, base + 6, 0x60ULL << base, 0x60ULL << base);
+      castle(us == WHITE ? WHITE_OOO : BLACK_OOO, base, base + 2, 0x0eULL << base, 0x0cULL << base);
+    }
+  }
+
+  void make(Move m, Undo& undo) {
+    int from = m.from(), to = m.to(), flag = m.flag();
+    Color us = side, them = (Color)(side ^ 1);
+    int8_t piece = board[from];
+    undo = Undo{board[to], castling, en_passant, halfmove_clock, key};
+    history[plies++ % history_size] = key;
+
+    key ^= state_key();
+    halfmove_clock++;
+    en_passant = -1;
+    if (flag == Move::EN_PASSANT) {
+      int captured = to + (us == WHITE ? -8 : 8);
+      undo.captured = board[captured];
+      remove(captured);
+    } else if (board[to] != NO_PIECE) {
+      remove(to);
+      halfmove_clock = 0;
+    }
+    remove(from);
+    put(to, m.is_promotion() ? make_piece(us, m.promotion()) : piece);
+    if (piece % 6 == PAWN) {
+      halfmove_clock = 0;
+      // only record a target that can actually be taken, like FEN
+      if (flag == Move::DOUBLE_PUSH && (attacks.pawn[us][(from + to) / 2] & pieces(them, PAWN))) {
+        en_passant = (from + to) / 2;
+      }
+    }
+    if (flag == Move::KING_CASTLE) {
+      put(to - 1, board[to + 1]);
+      remove(to + 1);
+    } else if (flag == Move::QUEEN_CASTLE) {
+      put(to + 1, board[to - 2]);
+      remove(to - 2);
+    }
+    castling &= castling_kept[from] & castling_kept[to];
+    if (us == BLACK) {
+      fullmove_number++;
+    }
+    side = them;
+    key ^= state_key();
+  }
+
+  void unmake(Move m, const Undo& undo) {
+    int from = m.from(), to = m.to(), flag = m.flag();
+    side = (Color)(side ^ 1);
+    if (side == BLACK) {
+      fullmove_number--;
+    }
+    Color us = side;
+    if (flag == Move::KING_CASTLE) {
+      put(to + 1, board[to - 1]);
+      remove(to - 1);
+    } else if (flag == Move::QUEEN_CASTLE) {
+      put(to - 2, board[to + 1]);
+      remove(to + 1);
+    }
+    int8_t piece = m.is_promotion() ? make_piece(us, PAWN) : board[to];
+    remove(to);
+    put(from, piece);
+    if (flag == Move::EN_PASSANT) {
+      put(to + (us == WHITE ? -8 : 8), undo.captured);
+    } else if (undo.captured != NO_PIECE) {
+      put(to, undo.captured);
+    }
+    castling = undo.castling;
+    en_passant = undo.en_passant;
+    halfmove_clock = undo.halfmove_clock;
+    key = undo.key;
+    plies--;
+  }
+
+  void play(Move m) {
+    Undo undo;
+    make(m, undo);
+  }
+
+  // Draws by the 50 move rule, threefold repetition or material no one can
+  // mate with (K v K, K v K+N, K v K+B: the draws thc's IsInsufficientDraw()
+  // grants automatically). Unlike board_is_terminal(), which asks thc's
+  // IsDraw() on Black's behalf, a lone white king against more material is
+  // not a draw; the game goes on to mate, stalemate or the 50 move rule.
+  // Repetitions count the positions make() went through, compared by key,
+  // back to the last capture or pawn move or `history_size` plies, whichever
+  // is nearer.
+  bool is_draw() const {
+    if (halfmove_clock >= 100 || is_repetition()) {
+      return true;
+    }
+    Bitboard heavy = by_type[PAWN] | by_type[ROOK] | by_type[QUEEN];
+    Bitboard minor = by_type[KNIGHT] | by_type[BISHOP];
+    return !heavy && std::popcount(minor) <= 1;
+  }
+
+  // `m` (legal here) in thc's terms, filled in the way thc's own move
+  // generator does so the two compare equal
+  thc::Move to_thc(Move m) const {
+    int from = m.from(), to = m.to(), flag = m.flag();
+    int8_t piece = board[from];
+    thc::Move move;
+    move.src = (thc::Square)(from ^ 56);
+    move.dst = (thc::Square)(to ^ 56);
+    move.capture = flag == Move::EN_PASSANT ? (side == WHITE ? 'p' : 'P') : board[to] == NO_PIECE ? ' ' : piece_chars[board[to]];
+    if (m.is_promotion()) {
+      static constexpr thc::SPECIAL promotions[] = {thc::SPECIAL_PROMOTION_KNIGHT, thc::SPECIAL_PROMOTION_BISHOP, thc::SPECIAL_PROMOTION_ROOK, thc::SPECIAL_PROMOTION_QUEEN};
+      move.special = promotions[flag & 3];
+    } else if (flag == Move::KING_CASTLE) {
+      move.special = side == WHITE ? thc::SPECIAL_WK_CASTLING : thc::SPECIAL_BK_CASTLING;
+    } else if (flag == Move::QUEEN_CASTLE) {
+      move.special = side == WHITE ? thc::SPECIAL_WQ_CASTLING : thc::SPECIAL_BQ_CASTLING;
+    } else if (flag == Move::EN_PASSANT) {
+      move.special = side == WHITE ? thc::SPECIAL_WEN_PASSANT : thc::SPECIAL_BEN_PASSANT;
+    } else if (flag == Move::DOUBLE_PUSH) {
+      move.special = side == WHITE ? thc::SPECIAL_WPAWN_2SQUARES : thc::SPECIAL_BPAWN_2SQUARES;
+    } else if (piece % 6 == KING) {
+      move.special = thc::SPECIAL_KING_MOVE;
+    } else {
+      move.special = thc::NOT_SPECIAL;
+    }
+    return move;
+  }
+
+  static Move from_thc(thc::Move move) {
+    int from = move.src ^ 56, to = move.dst ^ 56;
+    int capture = move.capture != ' ' ? Move::CAPTURE : 0;
+    switch (move.special) {
+    case thc::SPECIAL_WK_CASTLING:
+    case thc::SPECIAL_BK_CASTLING:
+      return Move(from, to, Move::KING_CASTLE);
+    case thc::SPECIAL_WQ_CASTLING:
+    case thc::SPECIAL_BQ_CASTLING:
+      return Move(from, to, Move::QUEEN_CASTLE);
+    case thc::SPECIAL_PROMOTION_KNIGHT:
+      return Move(from, to, Move::PROMOTION | capture | 0);
+    case thc::SPECIAL_PROMOTION_BISHOP:
+      return Move(from, to, Move::PROMOTION | capture | 1);
+    case thc::SPECIAL_PROMOTION_ROOK:
+      return Move(from, to, Move::PROMOTION | capture | 2);
+    case thc::SPECIAL_PROMOTION_QUEEN:
+      return Move(from, to, Move::PROMOTION | capture | 3);
+    case thc::SPECIAL_WEN_PASSANT:
+    case thc::SPECIAL_BEN_PASSANT:
+      return Move(from, to, Move::EN_PASSANT);
+    case thc::SPECIAL_WPAWN_2SQUARES:
+    case thc::SPECIAL_BPAWN_2SQUARES:
+      return Move(from, to, Move::DOUBLE_PUSH);
+    default:
+      return Move(from, to, capture ? Move::CAPTURE : Move::QUIET);
+    }
+  }
+
+  // whether this position occurred twice before (see is_draw())
+  bool is_repetition() const {
+    int back = std::min<int>({halfmove_clock, (int)plies, history_size});
+    int seen = 0;
+    // the side to move has to match, so only every other ply can repeat
+    for (int i = 4; i <= back; i += 2) {
+      if (history[(plies - i) % history_size] == key && ++seen == 2) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // keys of the last positions make() left; enough for the repetitions a
+  // search runs into without making positions expensive to copy
+  static constexpr int history_size = 32;
+
+private:
+  Bitboard by_color[2] = {};
+  Bitboard by_type[6] = {};
+  int8_t board[64];
+  Color side = WHITE;
+  uint8_t castling = 0;
+  int8_t en_passant = -1; // square a pawn can capture en passant onto, or -1
+  uint8_t halfmove_clock = 0;
+  uint16_t fullmove_number = 1;
+  uint64_t key = 0;
+  uint32_t plies = 0; // moves made since construction; history[i % history_size] is the key i plies in
+  uint64_t history[history_size];
+
+  // castling rights that survive a move from or to each square
+  static constexpr auto castling_kept = []() {
+    std::array<uint8_t, 64> kept{};
+    kept.fill(WHITE_OO | WHITE_OOO | BLACK_OO | BLACK_OOO);
+    kept[0] &= ~WHITE_OOO;
+    kept[7] &= ~WHITE_OO;
+    kept[4] &= ~(WHITE_OO | WHITE_OOO);
+    kept[56] &= ~BLACK_OOO;
+    kept[63] &= ~BLACK_OO;
+    kept[60] &= ~(BLACK_OO | BLACK_OOO);
+    return kept;
+  }();
+
+  int king_square(Color c) const {
+    return lsb(pieces(c, KING));
+  }
+
+  // pieces of `us` that would expose the king on `ksq` to a slider by moving
+  // off the line between them
+  Bitboard pinned_pieces(Color us, int ksq) const {
+    Color them = (Color)(us ^ 1);
+    Bitboard occ = occupied();
+    Bitboard snipers = (attacks.rook_attacks(ksq, 0) & (pieces(them, ROOK) | pieces(them, QUEEN)))
+                     | (attacks.bishop_attacks(ksq, 0) & (pieces(them, BISHOP) | pieces(them, QUEEN)));
+    Bitboard pinned = 0;
+    while (snipers) {
+      Bitboard blockers = attacks.between[ksq][pop_lsb(snipers)] & occ;
+      if (blockers && !(blockers & (blockers - 1))) {
+        pinned |= blockers & by_color[us];
+      }
+    }
+    return pinned;
+  }
+
+  // the part of the key that isn't pieces
+  uint64_t state_key() const {
+    return zobrist.castling[castling]
+         ^ (en_passant >= 0 ? zobrist.en_passant[en_passant % 8] : 0)
+         ^ (side == BLACK ? zobrist.black_to_move : 0);
+  }
+
+  void put(int sq, int8_t piece) {
+    board[sq] = piece;
+    by_color[piece / 6] |= bit(sq);
+    by_type[piece % 6] |= bit(sq);
+    key ^= zobrist.piece_square[piece][sq];
+  }
+
+  void remove(int sq) {
+    auto piece = board[sq];
+    board[sq] = NO_PIECE;
+    by_color[piece / 6] &= ~bit(sq);
+    by_type[piece % 6] &= ~bit(sq);
+    key ^= zobrist.piece_square[piece][sq];
+  }
+};
+
+} // namespace bb
@@ -1,4 +1,8 @@
 #include "thc.h"
+#include "bitboard.h"
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <torch/torch.h>
@@ -21,59 +25,39 @@ bool board_is_terminal(thc::ChessRules board) {
     return false;
 }
 
-torch::Tensor board_to_tensor(thc::ChessRules board) {
-  // returns a 119x8x8 tensor representing the board
+// The network's input is 119 planes of 8x8 floats per position, row-major
+// with thc's square order (a8 first).
+//
+// the first 6 planes are binary encodings of the white piece
+// positions: first place is pawns, etc.
+//
+// the next 6 planes are a binary encoding of the black piece positions along
+// the same lines.
+//
+// For now, the remaining planes are unused, but will later be used to
+// represent the previous k positions so the model can understand repetitions
+// and shit.
+constexpr int board_planes = 119;
+constexpr int piece_planes = 12;
+constexpr size_t board_floats = board_planes * 64;
 
-  // the first 6 planes are binary encodings of the white piece
-  // positions: first place is pawns, etc.
-  //
-  // the next 6 planes are a binary encoding of the black piece positions along
-  // the same lines.
-  //
-  // For now, the remaining planes are unused, but will later be used to
-  // represent the previous k positions so the model can understand repetitions
-  // and shit.
-
-  torch::Tensor tensor = torch::zeros({119, 8, 8});
-  for (int row = 0; row < 8; row++) {
-    for (int col = 0; col < 8; col++) {
-      char piece = board.squares[row*8 + col];
-      if (piece == '.') {
-        continue;
-      }
-      int channel = 0;
-      if (piece == 'P') {
-        channel = 0;
-      } else if (piece == 'N') {
-        channel = 1;
-      } else if (piece == 'B') {
-        channel = 2;
-      } else if (piece == 'R') {
-        channel = 3;
-      } else if (piece == 'Q') {
-        channel = 4;
-      } else if (piece == 'K') {
-        channel = 5;
-      } else if (piece == 'p') {
-        channel = 6;
-      } else if (piece == 'n') {
-        channel = 7;
-      } else if (piece == 'b') {
-        channel = 8;
-      } else if (piece == 'r') {
-        channel = 9;
-      } else if (piece == 'q') {
-        channel = 10;
-      } else if (piece == 'k') {
-        channel = 11;
-      } else {
-        channel = 12;
-        /* std::cout << "bad piece: " << piece << std::endl;
-        throw std::runtime_error("[ERROR]: invalid piece"); */
-      }
-      tensor[channel][row][col] = 1;
-    }
+// Writes `pos` into `out`, which holds board_floats floats. Only the piece
+// planes are written; the unused planes are left alone, so start from a
+// zeroed buffer (e.g. a row of the InferenceQueue's batch, which only ever
+// gets boards written into it). Pieces number "PNBRQKpnbrqk" in bitboard.h
+// too, so a piece's plane is the piece itself.
+void encode_board(const bb::Position& pos, float* out) {
+  std::memset(out, 0, piece_planes * 64 * sizeof(float));
+  for (auto b = pos.occupied(); b;) {
+    int sq = bb::pop_lsb(b);
+    out[pos.piece_on(sq) * 64 + (sq ^ 56)] = 1.0f;
   }
+}
+
+// returns a 119x8x8 tensor representing the position
+torch::Tensor board_to_tensor(const bb::Position& pos) {
+  torch::Tensor tensor = torch::zeros({board_planes, 8, 8});
+  encode_board(pos, tensor.data_ptr<float>());
   return tensor;
 }
 
@@ -91,7 +75,7 @@ std::string move_to_str(thc::ChessRules cr, thc::Move move) { // FIXME: cr argum
   return move.TerseOut();
 }
 
-thc::Move str_to_move(thc::ChessRules cr, std::string str) {
+thc::Move str_to_move(thc::ChessRules& cr, std::string str) {
   thc::Move move;
   if (!move.TerseIn(&cr, str.c_str())) {
     std::cout << "invalid move string: " << str << std::endl;
@@ -107,6 +91,36 @@ thc::Move str_to_move(thc::ChessRules cr, std::string str) {
   return move;
 }
 
+// Moves are the search's actions, and the search looks children up by action.
+template<>
+struct std::hash<thc::Move> {
+  size_t operator()(const thc::Move& move) const {
+    uint32_t bits;
+    std::memcpy(&bits, &move, sizeof(bits));
+    return std::hash<uint32_t>()(bits);
+  }
+};
+
+// Moves -> entries of the network's 4096-wide policy output. Entry
+// from * 64 + to, with squares numbered a1 = 0, b1 = 1, ..., h8 = 63 (thc
+// numbers them from a8 = 0). Promotions use the entry of their from/to
+// squares, so the four promotions of one pawn move share an entry.
+struct PolicyTables {
+  int policy_square[64]; // thc square -> policy square
+
+  PolicyTables() {
+    for (int sq = 0; sq < 64; sq++) {
+      policy_square[sq] = (sq % 8) + 8 * (7 - sq / 8);
+    }
+  }
+};
+
+const PolicyTables policy_tables;
+
+int policy_index(thc::Move move) {
+  return policy_tables.policy_square[move.src] * 64 + policy_tables.policy_square[move.dst];
+}
+
 void display_position( thc::ChessRules &cr, const std::string &description ) {
     std::string fen = cr.ForsythPublish();
     std::string s = cr.ToDebugStr();
@@ -0,0 +1,230 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <torch/torch.h>
+
+// Runs single-position network evaluations from every search thread through
+// the network in batches. Callers queue inputs with submit() (several at once
+// if they have them) and block in wait() or evaluate(); a dedicated thread
+// has each pending input written into its row of one preallocated batch,
+// runs one forward pass and hands each caller its row of the output. A batch runs as soon as `max_batch` inputs are queued,
+// as soon as all `clients` threads are blocked waiting (nobody is going to
+// add to it), or once the oldest input has waited `timeout`.
+//
+// Because only the queue's thread calls `forward`, the network is never run
+// from two threads at once.
+class InferenceQueue {
+public:
+  using Clock = std::chrono::steady_clock;
+  // maps a [B, ...] batch to a [B, ...] output, one row per input
+  using Forward = std::function<torch::Tensor(torch::Tensor)>;
+  // writes one input, of the queue's input shape, into the floats it's given
+  using Encode = std::function<void(float*)>;
+
+  struct Stats {
+    long batches = 0;
+    long items = 0;
+    long full_batches = 0; // batches that reached max_batch
+    double total_latency_us = 0; // from evaluate() to the result, summed over items
+    double max_latency_us = 0;
+  };
+
+  // `input_shape` is the shape of one input, without the batch dimension
+  InferenceQueue(Forward forward, std::vector<int64_t> input_shape, size_t max_batch, std::chrono::microseconds timeout, size_t clients)
+    : forward(std::move(forward)), input_shape(std::move(input_shape)), max_batch(std::max<size_t>(max_batch, 1)), timeout(timeout), clients(std::max<size_t>(clients, 1)) {
+    input_floats = 1;
+    for (auto n : this->input_shape) {
+      input_floats *= n;
+    }
+    worker = std::thread([this]() { work(); });
+  }
+
+  ~InferenceQueue() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      quit = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  InferenceQueue(const InferenceQueue &) = delete;
+  InferenceQueue &operator=(const InferenceQueue &) = delete;
+
+  // Queues one input, which `encode` writes straight into its row of the
+  // batch, so no tensor is made per input. `encode` runs on the queue's
+  // thread before the future is ready, so it may refer to the caller's data
+  // until the caller has the result. The row holds whatever the last input
+  // in it left (zeros at first), so `encode` has to overwrite everything that
+  // differs between inputs. The future is ready once the batch it ends up in
+  // has run, and rethrows whatever `encode` or `forward` threw.
+  std::future<torch::Tensor> submit(Encode encode) {
+    auto request = Request{std::move(encode), std::promise<torch::Tensor>(), Clock::now()};
+    auto result = request.result.get_future();
+    {
+      std::lock_guard<std::mutex> lock(m);
+      pending.push_back(std::move(request));
+    }
+    cv.notify_one();
+    return result;
+  }
+
+  // Blocks until `result` (from submit()) is ready. Use this rather than
+  // result.get(), so the queue knows this thread won't submit more for now.
+  torch::Tensor wait(std::future<torch::Tensor> &result) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      waiting++;
+    }
+    cv.notify_one();
+    auto waited = [this]() {
+      std::lock_guard<std::mutex> lock(m);
+      waiting--;
+    };
+    try {
+      auto value = result.get();
+      waited();
+      return value;
+    } catch (...) {
+      waited();
+      throw;
+    }
+  }
+
+  torch::Tensor evaluate(Encode encode) {
+    auto result = submit(std::move(encode));
+    return wait(result);
+  }
+
+  // `clients` is how many threads submit work, e.g. the number of search threads
+  void configure(size_t max_batch, std::chrono::microseconds timeout, size_t clients) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      this->max_batch = std::max<size_t>(max_batch, 1);
+      this->timeout = timeout;
+      this->clients = std::max<size_t>(clients, 1);
+    }
+    cv.notify_one();
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(m);
+    return totals;
+  }
+
+  void reset_stats() {
+    std::lock_guard<std::mutex> lock(m);
+    totals = Stats();
+  }
+
+  // one-line summary of the stats, for `info string`
+  std::string report() {
+    auto s = stats();
+    char buf[160];
+    std::snprintf(buf, sizeof(buf), "nn batches %ld avg fill %.2f/%zu full %.0f%% latency avg %.0fus max %.0fus",
+                  s.batches,
+                  s.batches > 0 ? (double)s.items / s.batches : 0.0,
+                  max_batch,
+                  s.batches > 0 ? 100.0 * s.full_batches / s.batches : 0.0,
+                  s.items > 0 ? s.total_latency_us / s.items : 0.0,
+                  s.max_latency_us);
+    return buf;
+  }
+
+private:
+  struct Request {
+    Encode encode;
+    std::promise<torch::Tensor> result;
+    Clock::time_point queued;
+  };
+
+  void work() {
+    for (;;) {
+      std::vector<Request> batch;
+      bool full;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return quit || !pending.empty(); });
+        if (pending.empty()) {
+          return;
+        }
+        cv.wait_until(lock, pending.front().queued + timeout, [this]() {
+          return quit || pending.size() >= max_batch || waiting >= clients;
+        });
+        auto n = std::min(pending.size(), max_batch);
+        full = n == max_batch;
+        for (size_t i = 0; i < n; i++) {
+          batch.push_back(std::move(pending.front()));
+          pending.pop_front();
+        }
+      }
+      run(batch, full);
+    }
+  }
+
+  void run(std::vector<Request> &batch, bool full) {
+    auto rows = std::vector<torch::Tensor>();
+    try {
+      auto n = (int64_t)batch.size();
+      // only grows, and only this thread touches it
+      if (capacity < n) {
+        auto shape = std::vector<int64_t>{n};
+        shape.insert(shape.end(), input_shape.begin(), input_shape.end());
+        inputs = torch::zeros(shape);
+        capacity = n;
+      }
+      auto data = inputs.data_ptr<float>();
+      for (int64_t i = 0; i < n; i++) {
+        batch[i].encode(data + i * input_floats);
+      }
+      auto output = forward(inputs.narrow(0, 0, n)).view({n, -1});
+      for (int64_t i = 0; i < n; i++) {
+        rows.push_back(output[i]);
+      }
+    } catch (...) {
+      for (auto &request : batch) {
+        request.result.set_exception(std::current_exception());
+      }
+      return;
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+      batch[i].result.set_value(rows[i]);
+    }
+
+    auto now = Clock::now();
+    std::lock_guard<std::mutex> lock(m);
+    totals.batches++;
+    totals.items += batch.size();
+    totals.full_batches += full;
+    for (auto &request : batch) {
+      auto latency = std::chrono::duration<double, std::micro>(now - request.queued).count();
+      totals.total_latency_us += latency;
+      totals.max_latency_us = std::max(totals.max_latency_us, latency);
+    }
+  }
+
+  Forward forward;
+  std::vector<int64_t> input_shape;
+  int64_t input_floats;
+  torch::Tensor inputs; // the batch, reused from one to the next
+  int64_t capacity = 0; // rows of `inputs`
+  size_t max_batch;
+  std::chrono::microseconds timeout;
+  size_t clients;
+  size_t waiting = 0; // threads blocked in wait()
+  std::deque<Request> pending;
+  Stats totals;
+  std::mutex m;
+  std::condition_variable cv;
+  bool quit = false;
+  std::thread worker;
+};
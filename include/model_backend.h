@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <torch/torch.h>
+#include <torch/script.h>
+
+// The apprentice network on one device (the CPU unless told otherwise).
+// Search evaluations run a frozen, inference-optimised copy of the TorchScript
+// module under InferenceMode, so they record no autograd state; training
+// updates `model` itself, after which refresh() rebuilds the copy.
+//
+// Batches go through the network in one forward pass if it handles them;
+// modules exported for one position at a time (e.g. by an older
+// src/sketch.py, whose heads flatten across the batch) get one forward pass
+// per position instead.
+class ModelBackend {
+public:
+  torch::jit::script::Module model; // the trainable module
+
+  // `input_shape` is the shape of one position's input, without the batch
+  // dimension
+  ModelBackend(torch::jit::script::Module module, std::vector<int64_t> input_shape, torch::Device device = torch::kCPU)
+    : model(std::move(module)), input_shape(std::move(input_shape)), dev(device) {
+    model.to(dev);
+    refresh();
+  }
+
+  ModelBackend(const ModelBackend &) = delete;
+  ModelBackend &operator=(const ModelBackend &) = delete;
+
+  const torch::Device &device() const {
+    return dev;
+  }
+
+  // Moves the model to `device`. Must not race with forward().
+  void to(torch::Device device) {
+    dev = device;
+    model.to(dev);
+    refresh();
+  }
+
+  // whether the module takes batches of more than one position
+  bool batched() const {
+    return takes_batches;
+  }
+
+  // Runs a [B, ...] batch on the inference copy and returns a [B, n] output,
+  // one row per position, on the CPU, where the search reads it.
+  torch::Tensor forward(torch::Tensor batch) {
+    torch::InferenceMode guard;
+    auto n = batch.size(0);
+    if (takes_batches || n == 1) {
+      return run(batch).view({n, -1}).to(torch::kCPU);
+    }
+    auto rows = std::vector<torch::Tensor>();
+    rows.reserve(n);
+    for (int64_t i = 0; i < n; i++) {
+      rows.push_back(run(batch.narrow(0, i, 1)).view({1, -1}));
+    }
+    return torch::cat(rows, 0).to(torch::kCPU);
+  }
+
+  // Rebuilds the inference copy from `model`, e.g. after training it. Falls
+  // back to an unfrozen copy for modules freezing can't handle.
+  void refresh() {
+    auto copy = model.clone();
+    copy.eval();
+    try {
+      frozen = torch::jit::freeze(copy);
+      if (dev.is_cpu()) {
+        frozen = torch::jit::optimize_for_inference(frozen);
+      }
+    } catch (const c10::Error &error) {
+      std::cerr << "[WARN] couldn't freeze the model, running it as is: " << error.what() << std::endl;
+      frozen = copy;
+    }
+    takes_batches = check_batches();
+    if (!takes_batches) {
+      std::cerr << "[WARN] the model only takes one position at a time; evaluating batches position by position (re-export it with src/sketch.py)" << std::endl;
+    }
+  }
+
+private:
+  torch::jit::script::Module frozen;
+  std::vector<int64_t> input_shape;
+  torch::Device dev;
+  bool takes_batches = false;
+
+  torch::Tensor run(torch::Tensor batch) {
+    return frozen.forward({batch.to(dev)}).toTensor();
+  }
+
+  // Whether a batch of two different positions comes out as the two rows the
+  // positions get on their own. A module that flattens across the batch
+  // either throws or lays the rows out differently.
+  bool check_batches() {
+    torch::InferenceMode guard;
+    auto shape = std::vector<int64_t>{2};
+    shape.insert(shape.end(), input_shape.begin(), input_shape.end());
+    auto inputs = torch::rand(shape);
+    try {
+      auto together = run(inputs).to(torch::kCPU);
+      auto first = run(inputs.narrow(0, 0, 1)).to(torch::kCPU).view({1, -1});
+      auto second = run(inputs.narrow(0, 1, 1)).to(torch::kCPU).view({1, -1});
+      auto apart = torch::cat({first, second}, 0);
+      return together.numel() == apart.numel() && torch::allclose(together.view({2, -1}), apart, 1e-4, 1e-5);
+    } catch (const c10::Error &) {
+      return false;
+    } catch (const std::runtime_error &) {
+      return false;
+    }
+  }
+};
+
+// libtorch runs ops on its own thread pools besides the search threads:
+// torch::set_num_threads() sizes the intra-op pool, which splits up a single
+// op, and this sizes the inter-op pool, which runs independent ops side by
+// side. libtorch only lets the inter-op pool be sized once, before its first
+// use; returns false if that was too late.
+inline bool set_interop_threads(int n) {
+  try {
+    torch::set_num_interop_threads(std::max(n, 1));
+  } catch (const c10::Error &) {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "thc.h"
+#include "bitboard.h"
+
+// Perft: the number of leaf nodes of the legal move tree to a fixed depth.
+// Comparing counts against known values checks a move generator; timing them
+// measures it. perft<Gen>() drives any move generator backend `Gen` with:
+//
+//   Position, MoveList (with .moves[] and .count), Move, Undo
+//   static Position from_fen(const std::string&)   throws on bad FEN
+//   static void generate(Position&, MoveList&)     legal moves only
+//   static void make(Position&, Move, Undo&)
+//   static void unmake(Position&, Move, const Undo&)
+//   static std::string uci(Position&, Move)        e.g. "e7e8q"
+//
+// With `bulk`, the last ply is counted from the size of the move list rather
+// than by playing each move, which is how perft is usually quoted.
+
+// thc::ChessRules, the mailbox generator from the vendored thc library
+struct ThcMoveGen {
+  using Position = thc::ChessRules;
+  using MoveList = thc::MOVELIST;
+  using Move = thc::Move;
+  struct Undo { };
+  static constexpr const char* name = "thc";
+
+  static Position from_fen(const std::string& fen) {
+    Position pos;
+    if (!pos.Forsyth(fen.c_str())) {
+      throw std::runtime_error("[ERROR]: invalid FEN: " + fen);
+    }
+    return pos;
+  }
+  static void generate(Position& pos, MoveList& list) {
+    pos.GenLegalMoveList(&list);
+  }
+  static void make(Position& pos, Move move, Undo&) {
+    pos.PushMove(move);
+  }
+  static void unmake(Position& pos, Move move, const Undo&) {
+    pos.PopMove(move);
+  }
+  static std::string uci(Position&, Move move) {
+    return move.TerseOut();
+  }
+};
+
+// bb::Position, the bitboard generator the search uses
+struct BitboardMoveGen {
+  using Position = bb::Position;
+  using MoveList = bb::MoveList;
+  using Move = bb::Move;
+  using Undo = bb::Undo;
+  static constexpr const char* name = "bitboard";
+
+  static Position from_fen(const std::string& fen) {
+    return Position::from_fen(fen);
+  }
+  static void generate(Position& pos, MoveList& list) {
+    pos.legal_moves(list);
+  }
+  static void make(Position& pos, Move move, Undo& undo) {
+    pos.make(move, undo);
+  }
+  static void unmake(Position& pos, Move move, const Undo& undo) {
+    pos.unmake(move, undo);
+  }
+  static std::string uci(Position& pos, Move move) {
+    return pos.to_thc(move).TerseOut();
+  }
+};
+
+template<typename Gen>
+uint64_t perft(typename Gen::Position& pos, int depth, bool bulk = true) {
+  if (depth <= 0) {
+    return 1;
+  }
+  typename Gen::MoveList list;
+  Gen::generate(pos, list);
+  if (bulk && depth == 1) {
+    return list.count;
+  }
+  uint64_t nodes = 0;
+  for (int i = 0; i < (int)list.count; i++) {
+    typename Gen::Undo undo;
+    Gen::make(pos, list.moves[i], undo);
+    nodes += perft<Gen>(pos, depth - 1, bulk);
+    Gen::unmake(pos, list.moves[i], undo);
+  }
+  return nodes;
+}
+
+// Perft split by root move ("divide"), to find where two generators disagree.
+template<typename Gen>
+std::vector<std::pair<std::string, uint64_t>> perft_divide(typename Gen::Position& pos, int depth, bool bulk = true) {
+  auto counts = std::vector<std::pair<std::string, uint64_t>>();
+  typename Gen::MoveList list;
+  Gen::generate(pos, list);
+  for (int i = 0; i < (int)list.count; i++) {
+    typename Gen::Undo undo;
+    auto name = Gen::uci(pos, list.moves[i]);
+    Gen::make(pos, list.moves[i], undo);
+    counts.emplace_back(name, perft<Gen>(pos, depth - 1, bulk));
+    Gen::unmake(pos, list.moves[i], undo);
+  }
+  return counts;
+}
+
+struct PerftCase {
+  const char* name;
+  const char* fen;
+  std::vector<uint64_t> nodes; // nodes[d - 1] is the count to depth d
+};
+
+// the usual test positions, with counts from the Chess Programming Wiki
+inline const std::vector<PerftCase> perft_suite = {
+  {"startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+   {20, 400, 8902, 197281, 4865609, 119060324}},
+  {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+   {48, 2039, 97862, 4085603, 193690690}},
+  {"position3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+   {14, 191, 2812, 43238, 674624, 11030083, 178633661}},
+  {"position4", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+   {6, 264, 9467, 422333, 15833292}},
+  {"position5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+   {44, 1486, 62379, 2103487, 89941194}},
+  {"position6", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+   {46, 2079, 89890, 3894594, 164075551}},
+};
+
+// Runs every suite position to `max_depth` (or as deep as its known counts
+// go) and prints each count, whether it matches and the speed. Returns
+// whether everything matched.
+template<typename Gen>
+bool run_perft_suite(int max_depth, bool bulk, std::ostream& out) {
+  bool ok = true;
+  uint64_t total_nodes = 0;
+  double total_seconds = 0.0;
+  for (auto& test : perft_suite) {
+    auto pos = Gen::from_fen(test.fen);
+    int depth = std::min<int>(max_depth, (int)test.nodes.size());
+    auto start = std::chrono::steady_clock::now();
+    auto nodes = perft<Gen>(pos, depth, bulk);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool match = nodes == test.nodes[depth - 1];
+    ok = ok && match;
+    total_nodes += nodes;
+    total_seconds += seconds;
+    out << Gen::name << " " << test.name << " depth " << depth << " nodes " << nodes
+        << (match ? " ok" : " FAIL, expected " + std::to_string(test.nodes[depth - 1]))
+        << " nps " << (uint64_t)(nodes / std::max(seconds, 1e-9)) << std::endl;
+  }
+  out << Gen::name << " total nodes " << total_nodes << " nps " << (uint64_t)(total_nodes / std::max(total_seconds, 1e-9))
+      << (ok ? " all ok" : " FAILED") << std::endl;
+  return ok;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+// xoshiro256** (Blackman & Vigna). Small, fast and good enough for rollouts;
+// satisfies UniformRandomBitGenerator so it works with <random>.
+class Xoshiro256 {
+public:
+  using result_type = uint64_t;
+
+  explicit Xoshiro256(uint64_t seed = 0) {
+    this->seed(seed);
+  }
+
+  // fills the state from `seed` with splitmix64, as the authors recommend
+  void seed(uint64_t seed) {
+    for (auto &word : s) {
+      seed += 0x9e3779b97f4a7c15;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      word = z ^ (z >> 31);
+    }
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  result_type operator()() {
+    auto result = rotl(s[1] * 5, 7) * 9;
+    auto t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+private:
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t s[4];
+};
+
+// Every thread draws from its own generator, so search threads never share
+// generator state. A thread's generator is seeded from the master seed and
+// the thread's stream number: the main thread is stream 0, ThreadPool worker
+// i is stream i + 1, and par_search() reseeds each job with a stream of its
+// own so root-parallel runs don't depend on which worker picks up which job.
+// Given the same master seed and the same commands, single-threaded and
+// root-parallel searches are reproducible.
+inline std::atomic<uint64_t> rng_master_seed{std::random_device{}()};
+inline std::atomic<uint64_t> rng_generation{0};
+
+struct ThreadRng {
+  Xoshiro256 gen;
+  uint64_t stream = 0;
+  uint64_t generation = std::numeric_limits<uint64_t>::max(); // master seed it was seeded from
+};
+inline thread_local ThreadRng thread_rng_state;
+
+// Sets the master seed; every thread reseeds on its next draw.
+inline void seed_rngs(uint64_t seed) {
+  rng_master_seed = seed;
+  rng_generation++;
+}
+
+// Reseeds the calling thread's generator as stream `stream` of the master seed.
+inline void set_rng_stream(uint64_t stream) {
+  auto &state = thread_rng_state;
+  state.stream = stream;
+  state.generation = rng_generation.load();
+  state.gen.seed(rng_master_seed.load() ^ (stream * 0xd1b54a32d192ed03));
+}
+
+inline Xoshiro256 &thread_rng() {
+  auto &state = thread_rng_state;
+  if (state.generation != rng_generation.load(std::memory_order_relaxed)) {
+    set_rng_stream(state.stream);
+  }
+  return state.gen;
+}
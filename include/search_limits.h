@@ -0,0 +1,88 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <optional>
+
+// When a search ends. Search threads check it between iterations; besides
+// the iteration budget a search can be bounded by a deadline, a depth, an
+// outside stop flag and, with `early_stop`, by the root decision being
+// settled. Converts from an int so `search(state, 800, ...)` still reads as
+// "800 iterations".
+struct SearchLimits {
+  using Clock = std::chrono::steady_clock;
+
+  int iters = std::numeric_limits<int>::max(); // iteration budget (`go nodes`)
+  std::optional<Clock::time_point> deadline;   // hard time limit
+  int depth = 0;           // stop once a playout leaves the tree this many plies down; 0 for none
+  bool early_stop = false; // stop once no remaining iterations could change the move
+  const std::atomic<bool>* stop = nullptr; // set from outside to end the search now
+  Clock::time_point start = Clock::now();
+
+  // deepest tree path a playout has taken so far; written by the searchers
+  mutable std::atomic<int> depth_reached = 0;
+
+  SearchLimits() = default;
+  SearchLimits(int iters) : iters(iters) { }
+  SearchLimits(const SearchLimits& other)
+    : iters(other.iters),
+      deadline(other.deadline),
+      depth(other.depth),
+      early_stop(other.early_stop),
+      stop(other.stop),
+      start(other.start),
+      depth_reached(other.depth_reached.load())
+  { }
+
+  bool stopped() const {
+    return stop != nullptr && stop->load(std::memory_order_relaxed);
+  }
+
+  bool expired() const {
+    return deadline.has_value() && Clock::now() >= *deadline;
+  }
+
+  void note_depth(int plies) const {
+    auto cur = depth_reached.load(std::memory_order_relaxed);
+    while (plies > cur && !depth_reached.compare_exchange_weak(cur, plies, std::memory_order_relaxed)) { }
+  }
+
+  // Iterations a search that has run `iters_done` of them can still expect
+  // to run: what's left of the budget, or what fits before the deadline at
+  // the rate seen so far, whichever is less.
+  long remaining(int iters_done) const {
+    long left = (long)iters - iters_done;
+    if (deadline.has_value()) {
+      auto now = Clock::now();
+      if (now >= *deadline) {
+        return 0;
+      }
+      auto elapsed = std::chrono::duration<double>(now - start).count();
+      auto to_go = std::chrono::duration<double>(*deadline - now).count();
+      if (elapsed > 0) {
+        left = std::min(left, (long)(iters_done / elapsed * to_go) + 1);
+      }
+    }
+    return std::max(left, 0L);
+  }
+};
+
+// Milliseconds to spend on a move, given the UCI `go` clock arguments, or
+// nullopt if the search isn't limited by time. A fixed `movetime` is used as
+// is. Otherwise the remaining time is split evenly over the moves to the next
+// time control (30 when `movestogo` isn't given) and most of the increment
+// is spent on top. `overhead` is kept back for communication delays, and a
+// move never takes more than half of what is left on the clock.
+inline std::optional<long> allocate_time(std::optional<long> time_left, long increment, std::optional<int> moves_to_go, std::optional<long> movetime, long overhead) {
+  if (movetime.has_value()) {
+    return std::max(*movetime - overhead, 1L);
+  }
+  if (!time_left.has_value()) {
+    return std::nullopt;
+  }
+  auto moves = std::max(moves_to_go.value_or(30), 1);
+  auto share = *time_left / moves + increment * 3 / 4;
+  auto cap = std::max(*time_left - overhead, 0L) / (moves == 1 ? 1 : 2);
+  return std::max(std::min(share, cap), 1L);
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "rng.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Long-lived worker threads that search jobs are dispatched to, so a move
+// doesn't pay for spawning and joining a thread per core. The engine creates
+// one at startup and resizes it when the UCI `Threads` option changes.
+//
+// Jobs must not wait on other jobs of the same pool; with every worker busy
+// waiting, nothing would be left to run them.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t num_threads, bool pin = false) {
+    start(num_threads, pin);
+  }
+
+  ~ThreadPool() {
+    stop();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const {
+    return workers.size();
+  }
+
+  // Replaces the workers with `num_threads` fresh ones, optionally pinning
+  // worker i to core i. Waits for queued jobs to finish first.
+  void resize(size_t num_threads, bool pin = false) {
+    stop();
+    start(num_threads, pin);
+  }
+
+  std::future<void> submit(std::function<void()> job) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+    auto future = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(m);
+      jobs.push([task]() { (*task)(); });
+    }
+    cv.notify_one();
+    return future;
+  }
+
+  // Runs job(0), ..., job(n-1) on the workers and waits for all of them.
+  // Rethrows the first exception a job threw.
+  void run(size_t n, const std::function<void(size_t)> &job) {
+    auto futures = std::vector<std::future<void>>();
+    for (size_t i = 0; i < n; i++) {
+      futures.push_back(submit([&job, i]() { job(i); }));
+    }
+    for (auto &future : futures) {
+      future.wait();
+    }
+    for (auto &future : futures) {
+      future.get();
+    }
+  }
+
+private:
+  void start(size_t num_threads, bool pin) {
+    quit = false;
+    for (size_t i = 0; i < std::max<size_t>(num_threads, 1); i++) {
+      workers.emplace_back([this, i, pin]() {
+        if (pin) {
+          pin_to_core(i);
+        }
+        set_rng_stream(i + 1);
+        work();
+      });
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      quit = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  }
+
+  void work() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return quit || !jobs.empty(); });
+        if (jobs.empty()) {
+          return;
+        }
+        job = std::move(jobs.front());
+        jobs.pop();
+      }
+      job();
+    }
+  }
+
+  static void pin_to_core(size_t i) {
+#ifdef __linux__
+    auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(i % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex m;
+  std::condition_variable cv;
+  bool quit = false;
+};
@@ -1,3 +1,4 @@
+#include <cassert>
 #include <random>
 #include <vector>
 
@@ -18,12 +19,31 @@ Iter argmax(Iter begin, Iter end, Pred f) {
   return best;
 }
 
-template<typename T>
-T select_randomly(std::mt19937& g, std::vector<T> in) {
+// uniformly random element of `in`; draws a single index rather than sampling
+template<typename T, typename Alloc, typename Rng>
+T select_randomly(Rng& g, const std::vector<T, Alloc>& in) {
   assert(in.size() > 0);
-  std::vector<T> out;
-  std::sample(in.begin(), in.end(), std::back_inserter(out), 
-              1,
-              g);
-  return out[0];
-}
\ No newline at end of file
+  return in[std::uniform_int_distribution<size_t>(0, in.size() - 1)(g)];
+}
+
+// index drawn with probability proportional to `weights`; uniform over
+// [0, n) if the weights are missing or sum to zero
+template<typename Rng>
+size_t select_weighted(Rng& g, const std::vector<double>& weights, size_t n) {
+  assert(n > 0);
+  double sum = 0.0;
+  for (auto w : weights) {
+    sum += w > 0.0 ? w : 0.0;
+  }
+  if (weights.size() != n || !(sum > 0.0)) {
+    return std::uniform_int_distribution<size_t>(0, n - 1)(g);
+  }
+  auto r = std::uniform_real_distribution<double>(0.0, sum)(g);
+  for (size_t i = 0; i < n; i++) {
+    r -= weights[i] > 0.0 ? weights[i] : 0.0;
+    if (r < 0.0) {
+      return i;
+    }
+  }
+  return n - 1;
+}
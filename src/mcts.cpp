@@ -12,24 +12,67 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <limits>
+#include <unordered_map>
 #include <ranges>
 #include <torch/torch.h>
 #include <torch/script.h>
 #include "util.h"
+#include "arena.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include "search_limits.h"
+#include "inference_queue.h"
+#include "model_backend.h"
 #include "tictactoe.h"
 #include "thc.h"
 #include "chess_support.h"
+#include "perft.h"
 
-std::random_device rd;
-std::mt19937 g(rd());
+// The apprentice's policy prior of each of some actions at a state, and its
+// value of the state, from one evaluation.
+struct Prediction {
+  std::vector<double> priors; // empty for uniform
+  double value;
+};
 
 template <class S, class A>
 class Apprentice {
   public:
-    std::function<torch::Tensor(S)> action_dist;
-    std::function<double(S)> eval;
+    std::function<double(S)> eval; // value of a state for the side to move there
     std::function<void(std::vector<S>, std::vector<A>, double)> train;
-    Apprentice(std::function<torch::Tensor(S)> action_dist, std::function<double(S)> eval, std::function<void(std::vector<S>, std::vector<A>, double)> train): action_dist(action_dist), eval(eval), train(train) {  };
+    std::function<std::vector<double>(std::vector<S>)> eval_many; // eval of several states at once; defaults to one eval per state
+    std::function<std::vector<double>(S, std::vector<A>)> priors; // policy prior of each of the actions at a state; null for uniform
+    std::function<Prediction(S, std::vector<A>)> predict; // priors and eval together; defaults to calling both
+
+    Apprentice(std::function<double(S)> eval, std::function<void(std::vector<S>, std::vector<A>, double)> train, std::function<std::vector<double>(std::vector<S>)> eval_many = nullptr, std::function<std::vector<double>(S, std::vector<A>)> priors = nullptr, std::function<Prediction(S, std::vector<A>)> predict = nullptr)
+    : eval(eval), train(train), eval_many(eval_many), priors(priors), predict(predict) {
+      if (!this->predict) {
+        this->predict = [eval, priors](S state, std::vector<A> actions) {
+          return Prediction{priors ? priors(state, actions) : std::vector<double>(), eval(state)};
+        };
+      }
+      if (!this->eval_many) {
+        this->eval_many = [eval](std::vector<S> states) {
+          auto values = std::vector<double>();
+          values.reserve(states.size());
+          for (auto& state : states) {
+            values.push_back(eval(state));
+          }
+          return values;
+        };
+      }
+    };
+};
+
+// Everything the search asks about a state, answered at once: whether it's
+// terminal, its reward if so, and its actions if not.
+template <typename A>
+struct Step {
+  std::vector<A> actions; // empty at terminal states
+  bool terminal;
+  double reward; // only set at terminal states
 };
 
 template <typename S, typename A>
@@ -39,437 +82,868 @@ class MDP {
     std::function<std::vector<A>(S s)> actions; // actions at s
     std::function<std::optional<double>(S s)> reward; // reward at s
     std::function<bool(S s)> is_terminal; // is s terminal?
+    std::function<void(S& s, A a)> play; // in-place tr, so rollouts don't copy the state every ply
+    // is_terminal, actions and reward in one go; MDPs that can answer them
+    // together (e.g. from one move generation) should provide it
+    std::function<Step<A>(const S& s)> step;
+
+    MDP(std::function<S(S s, A a)> tr, std::function<std::optional<double>(S s)> reward, std::function<std::vector<A>(S s)> actions, std::function<bool(S s)> is_terminal, std::function<void(S& s, A a)> play = nullptr, std::function<Step<A>(const S& s)> step = nullptr)
+    : tr(tr), reward(reward), actions(actions), is_terminal(is_terminal), play(play), step(step) {
+      if (!this->play) {
+        this->play = [tr](S& s, A a) { s = tr(s, a); };
+      }
+      if (!this->step) {
+        this->step = [actions, reward, is_terminal](const S& s) {
+          if (!is_terminal(s)) {
+            return Step<A>{actions(s), false, 0.0};
+          }
+          auto r = reward(s);
+          if (!r.has_value()) {
+            throw std::runtime_error("[ERROR]: no reward at terminal state; check your MDP.");
+          }
+          return Step<A>{{}, true, r.value()};
+        };
+      }
+    };
+};
 
-    MDP(std::function<S(S s, A a)> tr, std::function<std::optional<double>(S s)> reward, std::function<std::vector<A>(S s)> actions, std::function<bool(S s)> is_terminal)
-    : tr(tr), reward(reward), actions(actions), is_terminal(is_terminal) {  };
+// How select() picks among expanded children. UCT is UCB1 on the children's
+// mean reward (plus the apprentice's value unless bootstrapping). PUCT is
+// AlphaZero's rule, steering visits by the policy priors stored on the edges
+// at expansion; with PUCT the search's exploration_bias is c_puct.
+enum class Selection { UCT, PUCT };
+
+// How the leaf a playout reaches is scored for backprop. Rollout plays the
+// game out (at random when bootstrapping, else sampling the apprentice's
+// policy). Value backs up the apprentice's value of the leaf. Hybrid mixes the
+// two, AlphaGo style, with a rollout cut off after `rollout_plies` and scored
+// by the value where it stops.
+struct LeafEval {
+  enum Mode { Rollout, Value, Hybrid };
+  Mode mode = Rollout;
+  int rollout_plies = 16; // Hybrid only
+  double mix = 0.5;       // Hybrid only: weight of the rollout against the leaf's value
 };
 
+template <typename S, typename A>
+class ExItNode;
+
+// Everything the nodes of one tree share. Nodes point at their tree's context
+// instead of each carrying copies of the MDP's and apprentice's callables.
+// Each par_search worker gets its own context (and with it its own arena).
+template <typename S, typename A>
+class SearchContext {
+  public:
+    MDP<S,A> mdp;
+    Apprentice<S,A> apprentice;
+    NodeArena arena; // every node of the tree is allocated here
+    // contexts of worker trees whose nodes were grafted onto this tree by
+    // merge(); they are kept alive until the tree is reset
+    std::vector<std::unique_ptr<SearchContext<S,A>>> adopted;
+    SearchContext<S,A>* owner = nullptr; // context that adopted this one
+    uint64_t searches = 0; // par_search() calls so far; numbers their jobs' RNG streams
+
+    SearchContext(MDP<S,A> mdp, Apprentice<S,A> apprentice) : mdp(mdp), apprentice(apprentice) {  };
+
+    template <class... Args>
+    ExItNode<S,A>* new_node(Args&&... args) {
+      return arena.make<ExItNode<S,A>>(std::forward<Args>(args)...);
+    }
+
+    // takes over `other` (and whatever it adopted) after merge() grafted
+    // its nodes onto this tree
+    void adopt(std::unique_ptr<SearchContext<S,A>> other) {
+      for (auto& c : other->adopted) {
+        c->owner = this;
+        adopted.push_back(std::move(c));
+      }
+      other->adopted.clear();
+      other->owner = this;
+      adopted.push_back(std::move(other));
+    }
+
+    // the context owning the whole tree a node of this context belongs to
+    SearchContext<S,A>* tree() {
+      return owner != nullptr ? owner : this;
+    }
+
+    // drops every node of the tree, including adopted ones
+    void reset() {
+      arena.reset();
+      adopted.clear();
+    }
+
+    // grafted nodes still allocate from their own context's arena
+    void set_shared(bool shared) {
+      arena.set_shared(shared);
+      for (auto& c : adopted) {
+        c->arena.set_shared(shared);
+      }
+    }
+};
+
+// Nodes live in their context's NodeArena and are never deleted
+// individually; dropping a tree is a NodeArena::reset().
+//
+// A node does not store its state. It only records the action that led to it
+// from its parent; the state is rebuilt by replaying actions from the state
+// of the node search() was called on, which the caller passes in.
 template <typename S, typename A>
 class ExItNode {
 public:
-  MDP<S,A> mdp;
-  Apprentice<S,A> apprentice;
-  S state;
-  std::vector<ExItNode<S,A>*> children;
+  using Children = std::vector<ExItNode<S,A>*, ArenaAllocator<ExItNode<S,A>*>>;
+
+  SearchContext<S,A>* ctx;
+  A action; // action taken in the parent's state to get here; unused at the root
+  Children children;
   std::optional<ExItNode<S,A>*> parent;
-  std::optional<double> expected;
-  double tot;
-  int count;
-
-  ExItNode(MDP<S,A> mdp, Apprentice<S,A> apprentice, S state, std::vector<ExItNode<S,A>*> children, std::optional<ExItNode<S,A>*> parent)
-    : mdp(mdp),
-      state(state),
-      children(children),
+  // Statistics are atomic so tree_par_search() threads can share the tree.
+  // During a tree-parallel search they include virtual losses of playouts
+  // still in flight.
+  std::atomic<double> tot;
+  std::atomic<int> count;
+  std::atomic<bool> expanded; // `children` is filled in and safe to read
+  std::atomic_flag expanding; // taken by the thread that expands this node
+  // Apprentice's value of this node's state and policy prior of `action`.
+  // The prior is filled in when the parent is expanded under PUCT; the value
+  // then too by a non-bootstrap UCT search, or when this node itself is
+  // expanded by a non-bootstrap PUCT search. Read-only after that.
+  float value;
+  float prior;
+  // Set once a playout has found this node's state terminal, with the
+  // state's reward in `outcome`, so later playouts ending here don't ask the
+  // MDP again. (Non-terminal states are remembered by being expanded.)
+  // Under tree parallelism several threads can find the same terminal leaf
+  // at once, so `outcome` is atomic too; they all store the same reward.
+  std::atomic<bool> terminal;
+  std::atomic<float> outcome;
+
+  ExItNode(SearchContext<S,A>* ctx, std::optional<ExItNode<S,A>*> parent)
+    : ctx(ctx),
+      action(),
+      children(Children(&ctx->arena)),
       parent(parent),
-      expected(std::nullopt),
       tot(0),
       count(0),
-      apprentice(apprentice)
+      expanded(false),
+      value(0),
+      prior(0),
+      terminal(false),
+      outcome(0)
     {
       // assert(!this->parent.has_value() || this->parent.value() != nullptr);
     };
 
-    ExItNode(const ExItNode<S,A> &other, std::optional<ExItNode<S,A>*> parent):
-      apprentice(other.apprentice),
-      mdp(other.mdp),
-      state(other.state),
-      children(std::vector<ExItNode<S,A>*>()),
+    // deep copy of `other`'s subtree into the tree of `ctx`
+    ExItNode(const ExItNode<S,A> &other, std::optional<ExItNode<S,A>*> parent, SearchContext<S,A>* ctx):
+      ctx(ctx),
+      action(other.action),
+      children(Children(&ctx->arena)),
       parent(parent),
-      expected(other.expected),
-      tot(other.tot),
-      count(other.count)
+      tot(other.tot.load()),
+      count(other.count.load()),
+      expanded(other.expanded.load()),
+      value(other.value),
+      prior(other.prior),
+      terminal(other.terminal.load()),
+      outcome(other.outcome.load())
     {
       // assert(!this->parent.has_value() || this->parent.value() != nullptr);
+      this->children.reserve(other.children.size());
       for (auto child : other.children) {
-        this->children.push_back(new ExItNode<S,A>(*child, this));
+        this->children.push_back(ctx->new_node(*child, this, ctx));
       }
     }
 
-  ExItNode(ExItNode<S,A>* parent, S state)
-  : mdp(parent->mdp),
-    apprentice(parent->apprentice),
-    state(state),
+  ExItNode(ExItNode<S,A>* parent, A action)
+  : ctx(parent->ctx),
+    action(action),
+    children(Children(&parent->ctx->arena)),
     parent(parent),
     tot(0),
-    count(0)
+    count(0),
+    expanded(false),
+    value(0),
+    prior(0),
+    terminal(false),
+    outcome(0)
   { };
 
-  ~ExItNode() {
-    for (auto child : children) {
-      delete child;
+  // Adds the statistics of `other`, a tree searched from the same state as
+  // this node, into this subtree. Children are keyed by action; matching
+  // children are merged recursively down to `depth` plies below this node,
+  // anything deeper in `other` is dropped. Children only `other` has are
+  // grafted on as they are rather than copied, so `other`'s context has to
+  // outlive this tree (see SearchContext::adopt). `other` is consumed.
+  void merge(ExItNode<S,A> *other, int depth = std::numeric_limits<int>::max()) {
+    this->tot += other->tot.load();
+    this->count += other->count.load();
+    if (other->terminal.load()) {
+      this->set_terminal(other->outcome.load());
+    }
+    if (depth <= 0 || other->children.empty()) {
+      return;
     }
-  }
 
-  void merge(ExItNode<S,A> *other) {
-    // TODO: fill this in
-    // if (this->is_root() && other->is_root() && this->state != other->state) {
-    //   throw std::runtime_error("Can't merge two roots with different states");
-    // }
-    if (this->is_root() && !other->is_root() || !this->is_root() && other->is_root()) {
-      throw std::runtime_error("Can't merge a root with a non-root");
-    }
-    if (this->state != other->state) {
-      throw std::runtime_error("Can't merge two nodes with different states");
-    }
-    this->tot += other->tot;
-    this->count += other->count;
-
-    for (auto their_child : other->children) {
-      auto our_child = std::find_if(this->children.begin(),
-                                    this->children.end(),
-                                    [their_child](ExItNode<S,A>* our_child) {
-                                      return our_child->state == their_child->state;
-                                    });
-      if (our_child != this->children.end()) {
-        (*our_child)->merge(their_child);
+    // expansions of the same state list their children in the same order, so
+    // the index usually finds the match; fall back to a hash lookup otherwise
+    std::unordered_map<A, ExItNode<S,A>*> by_action;
+    auto our_size = this->children.size();
+    for (size_t i = 0; i < other->children.size(); i++) {
+      auto their_child = other->children[i];
+      ExItNode<S,A>* our_child = nullptr;
+      if (i < our_size && this->children[i]->action == their_child->action) {
+        our_child = this->children[i];
+      } else {
+        if (by_action.empty()) {
+          for (size_t j = 0; j < our_size; j++) {
+            by_action.emplace(this->children[j]->action, this->children[j]);
+          }
+        }
+        auto it = by_action.find(their_child->action);
+        if (it != by_action.end()) {
+          our_child = it->second;
+        }
+      }
+      if (our_child != nullptr) {
+        our_child->merge(their_child, depth - 1);
       } else {
-        this->children.push_back(new ExItNode<S,A>(*their_child,this));
+        their_child->parent = this;
+        this->children.push_back(their_child);
       }
     }
+    this->expanded = true;
+  }
+
+  // Statistics of a node and its children, detached from any tree. This is
+  // what root-parallel workers hand back when they don't keep their trees.
+  struct Summary {
+    A action;
+    double tot;
+    int count;
+    float value;
+    float prior;
+    std::vector<Summary> children;
+  };
+
+  // Statistics of this node and the `plies` plies below it. Expanded nodes
+  // list all of their children, so absorb() never leaves a node half expanded.
+  Summary summarize(int plies) const {
+    auto summary = Summary{action, tot.load(), count.load(), value, prior, {}};
+    if (plies > 0) {
+      summary.children.reserve(children.size());
+      for (auto child : children) {
+        summary.children.push_back(child->summarize(plies - 1));
+      }
+    }
+    return summary;
+  }
+
+  // Adds a summary of a search from this node's state into this subtree,
+  // creating children this tree doesn't have yet.
+  void absorb(const Summary& summary) {
+    this->tot += summary.tot;
+    this->count += summary.count;
+    if (summary.children.empty()) {
+      return;
+    }
+    for (size_t i = 0; i < summary.children.size(); i++) {
+      auto& their_child = summary.children[i];
+      auto our_child = this->find_child(their_child.action, i);
+      if (our_child == nullptr) {
+        our_child = ctx->new_node(this, their_child.action);
+        our_child->value = their_child.value;
+        our_child->prior = their_child.prior;
+        this->children.push_back(our_child);
+      }
+      our_child->absorb(their_child);
+    }
+    this->expanded = true;
+  }
+
+  // The child reached by `action`, or nullptr. `hint` is the index to try
+  // first: expand() stores children in the order of mdp.actions(), so two
+  // expansions of the same state line up index for index.
+  inline ExItNode<S,A>* find_child(const A& action, size_t hint = 0) {
+    if (hint < children.size() && children[hint]->action == action) {
+      return children[hint];
+    }
+    for (auto child : children) {
+      if (child->action == action) {
+        return child;
+      }
+    }
+    return nullptr;
+  }
+
+  // The action leading to the child with the highest expected value.
+  inline A best_action() {
+    auto best = argmax(children.begin(), children.end(), [](ExItNode<S,A>* child) {
+      return child->expected().value_or(-std::numeric_limits<double>::infinity()); // we never pick an unexplored child
+    });
+    if (best == children.end()) {
+      throw std::runtime_error("[ERROR]: no actions available at non-terminal state");
+    }
+    return (*best)->action;
   }
 
   ExItNode* play(std::vector<A> actions) {
     ExItNode* cur = this;
     for (auto action : actions) {
-      auto child = std::find_if(cur->children.begin(), cur->children.end(),
-                                [&cur, &action](ExItNode<S,A>* child)
-                                  { return cur->mdp.tr(cur->state, action) == child->state; });
-      if (child != children.end() && !cur->children.empty()) {
-        cur = *child;
+      auto child = cur->find_child(action);
+      if (child != nullptr) {
+        cur = child;
       } else {
-        auto next_state = cur->mdp.tr(cur->state, action);
-        auto next_node = new ExItNode(cur, next_state);
+        auto next_node = ctx->new_node(cur, action);
         cur->children.push_back(next_node);
+        cur->expanded = true;
         cur = next_node;
       }
     }
     return cur;
   }
 
-  void debug() {
-    // action is the action from parent actions that got us from parent state to this state
-    int action;
-    if (!parent.has_value()) {
-      action = -1;
-    } else {
-      auto actions = mdp.actions(parent.value()->state);
-      action = *std::find_if(actions.begin(), actions.end(), [this](A a) { return mdp.tr(parent.value()->state, a) == this->state; });
-    }
-    printf("[node info] player: %c; E = %f; A = %d; R = %f; tot = %f; count = %d\n", this->state.player, this->expected.value_or(0.0), action, *mdp.reward(this), this->tot, this->count);
-  }
-
   inline bool is_root() {
     return !parent.has_value();
   }
 
   inline bool is_leaf() {
-    return children.size() == 0;
+    return !expanded.load(std::memory_order_acquire);
   }
 
-  inline void backprop() {
-    ExItNode* cur = this;
-    auto mreward = mdp.reward(cur->state);
-    if (!mreward.has_value()) {
-      throw std::runtime_error("[ERROR]: no reward at terminal state; check your MDP.");
+  inline void set_terminal(double reward) {
+    outcome.store(reward, std::memory_order_relaxed);
+    terminal.store(true, std::memory_order_release);
+  }
+
+  inline std::optional<double> expected() {
+    auto n = count.load(std::memory_order_relaxed);
+    if (n == 0) {
+      return std::nullopt;
     }
-    auto reward = mreward.value();
+    return tot.load(std::memory_order_relaxed) / n;
+  }
+
+  // Makes this node look like it lost `virtual_loss` more playouts, so other
+  // threads steer away from it until backprop() takes the losses back.
+  inline void add_virtual_loss(int virtual_loss) {
+    tot.fetch_add(-virtual_loss, std::memory_order_relaxed);
+    count.fetch_add(virtual_loss, std::memory_order_relaxed);
+  }
+
+  // `reward` is the outcome of a playout through this node, from this node's
+  // point of view (see terminal_reward()). If the playout put `virtual_loss`
+  // on the nodes below `search_root`, it is removed from them on the way up.
+  inline void backprop(double reward, ExItNode<S,A>* search_root = nullptr, int virtual_loss = 0) {
+    ExItNode* cur = this;
 
     // FIXME: generalize this with mdp.stride or something
     int parity = -1;
-    while (cur->parent.has_value()) {
-      cur->tot += parity*reward;
-      cur->count += 1;
-      cur->expected = cur->tot / cur->count;
+    for (;;) {
+      if (cur == search_root) {
+        virtual_loss = 0;
+      }
+      cur->tot.fetch_add(parity*reward + virtual_loss, std::memory_order_relaxed);
+      cur->count.fetch_add(1 - virtual_loss, std::memory_order_relaxed);
+      // keep going up to the root; this is required for UCT to compute the correct score for the root's direct children
+      if (!cur->parent.has_value()) {
+        break;
+      }
       cur = cur->parent.value();
       parity *= -1;
     }
-    // annotate root; this is required for UCT to compute the correct score for the root's direct children
-    cur->tot += parity*reward;
-    cur->count += 1;
-    cur->expected = cur->tot / cur->count;
   }
 
-  inline double score(int cur_itersm1, double exploration_bias, bool bootstrap) {
+  // UCT score plus a bonus from the apprentice's value, cached by expand(),
+  // or the PUCT score from the cached prior. The value is for the side to
+  // move at this node, i.e. the opponent of whoever picks it, so it counts
+  // against the node the way backprop() counts leaf values.
+  inline double score(int cur_itersm1, double exploration_bias, bool bootstrap, Selection selection) {
+      if (selection == Selection::PUCT) {
+        auto n = (double)this->count.load(std::memory_order_relaxed);
+        auto parent_n = (double)this->parent.value()->count.load(std::memory_order_relaxed);
+        // an unvisited parent (e.g. one play() made) still ranks by prior
+        return this->expected().value_or(0.0) + exploration_bias * this->prior * sqrt(std::max(parent_n, 1.0)) / (1.0 + n);
+      }
       auto bonus_weight = 0.5;
       auto exploration_term = exploration_bias * sqrt((double)log((double)this->parent.value()->count + (double)1.0) / ((double)this->count + (double)1.0));
-      auto exp = this->expected.value_or(0.0);
-      auto bonus_term = bootstrap ? 0.0 : bonus_weight * this->apprentice.eval(this->state);
+      auto exp = this->expected().value_or(0.0);
+      auto bonus_term = bootstrap ? 0.0 : -bonus_weight * this->value;
       return exp + bonus_term + exploration_term;
   }
 
-  inline std::optional<ExItNode<S,A>*> select(int cur_itersm1, double exploration_bias, bool bootstrap) {
+  inline std::optional<ExItNode<S,A>*> select(int cur_itersm1, double exploration_bias, bool bootstrap, Selection selection) {
     if (children.size() == 0) {
       return std::nullopt;
     }
 
-    // if all of the children have a null expected value, then select one at random
-    if (std::all_of(children.begin(), children.end(), [](ExItNode<S,A>* child) { return child->expected == std::nullopt; })) {
-      return select_randomly(g, children);
+    // if all of the children have a null expected value, then select one at
+    // random; PUCT goes by the priors instead
+    if (selection == Selection::UCT && std::all_of(children.begin(), children.end(), [](ExItNode<S,A>* child) { return child->count.load(std::memory_order_relaxed) == 0; })) {
+      return select_randomly(thread_rng(), children);
     }
 
-    // otherwise pick the child with the best UCT score
+    // otherwise pick the child with the best score
     auto best = argmax(children.begin(), children.end(),
                        [&](ExItNode<S,A>* child) {
-                         return child->score(cur_itersm1, exploration_bias, bootstrap);
+                         return child->score(cur_itersm1, exploration_bias, bootstrap, selection);
                        });
     return *best;
   }
 
-  // Expands `node` and returns a randomly selected child node.
-  inline ExItNode<S,A> *expand() {
+  // Expands `node` (whose state is `state`, with legal `actions`) and returns
+  // the node to evaluate, or nullptr if another thread is in the middle of
+  // expanding it. The apprentice is asked once per expansion, so selection
+  // only reads cached numbers:
+  //  - under UCT, unless `bootstrap` is set, for the children's values; the
+  //    returned node is a random child
+  //  - under PUCT, for this node's policy and value in one evaluation; the
+  //    priors go to the children, and the value to this node, which is what's
+  //    returned (AlphaZero style). Bootstrapping only uses the priors and
+  //    returns the child with the highest prior to roll out from.
+  inline ExItNode<S,A> *expand(const S& state, const std::vector<A>& actions, bool bootstrap, Selection selection, double exploration_bias) {
+    bool values_self = selection == Selection::PUCT && !bootstrap;
+    if (this->expanding.test_and_set(std::memory_order_acquire)) {
+      if (this->is_leaf()) {
+        return nullptr;
+      }
+      return values_self ? this : select_randomly(thread_rng(), this->children);
+    }
     if (this->children.size() == 0) {
-      auto actions = mdp.actions(state);
       if (actions.size() == 0) {
           throw std::runtime_error("[ERROR]: no actions available for expansion");
       }
 
-      auto new_children = std::vector<ExItNode<S,A>*>();
+      this->children.reserve(actions.size());
       for (auto action : actions) {
-        auto child = new ExItNode(this, this->mdp.tr(this->state, action));
-        new_children.push_back(child);
+        this->children.push_back(ctx->new_node(this, action));
+      }
+      if (selection == Selection::PUCT) {
+        auto prediction = ctx->apprentice.predict(state, actions);
+        set_priors(prediction.priors);
+        this->value = prediction.value;
+      } else if (!bootstrap) {
+        auto states = std::vector<S>();
+        states.reserve(actions.size());
+        for (auto& action : actions) {
+          states.push_back(ctx->mdp.tr(state, action));
+        }
+        auto values = ctx->apprentice.eval_many(states);
+        for (size_t i = 0; i < children.size(); i++) {
+          children[i]->value = values[i];
+        }
       }
-      this->children.clear();
-      this->children = new_children;
     }
-    
-    auto choice = select_randomly(g, this->children);
+    this->expanded.store(true, std::memory_order_release);
+
+    if (values_self) {
+      return this;
+    }
+    if (selection == Selection::PUCT) {
+      return select(0, exploration_bias, bootstrap, selection).value();
+    }
+    auto choice = select_randomly(thread_rng(), this->children);
     return choice;
   }
 
-    inline std::vector<ExItNode<S, A>*> dm_rollout() {
-      std::vector<ExItNode*> rollout_nodes;
-      ExItNode<S,A>* cur = this;
-      while (!mdp.is_terminal(cur->state)) {
-        auto legal_moves = mdp.actions(cur->state);
+  // Sets the children's priors from the apprentice's policy over this node's
+  // legal actions, renormalised so the priors of the legal moves sum to one.
+  // Uniform if the apprentice has no policy or puts no mass on any legal move.
+  inline void set_priors(const std::vector<double>& priors) {
+    double sum = 0.0;
+    for (auto p : priors) {
+      sum += std::max(p, 0.0);
+    }
+    for (size_t i = 0; i < children.size(); i++) {
+      children[i]->prior = sum > 0.0 ? std::max(priors[i], 0.0) / sum : 1.0 / children.size();
+    }
+  }
+
+    // Rollouts play out a private copy of `state` (this node's state, whose
+    // step() is `step`) in place and return the reward at the terminal state
+    // they reach, as seen from this node, i.e. ready to hand to backprop(). A
+    // rollout cut short by `max_plies` returns the apprentice's value where it
+    // stopped instead. Each ply asks the MDP for one step(), which gives both
+    // the terminal check and the moves to pick from.
+    inline double dm_rollout(S state, Step<A> step, int max_plies = std::numeric_limits<int>::max()) {
+      int plies = 0;
+      while (!step.terminal) {
+        if (plies == max_plies) {
+          return value_reward(state, plies);
+        }
+        auto& legal_moves = step.actions;
         if (legal_moves.size() < 1) {
           throw std::runtime_error("[ERROR]: no actions available at non-terminal state");
         }
-        int tries = 0;
-        for (;;) {
-          // assert(legal_moves.size() > 0);
-          if (tries > 0) {
-            // too many tries to sample a legal move from the net, we're just
-            // going to do a random rollout here.
-            cur = new ExItNode<S,A>(cur->mdp, cur->apprentice, mdp.tr(cur->state, select_randomly(g, legal_moves)), std::vector<ExItNode<S,A>*>(), cur);
-            rollout_nodes.push_back(cur);
-            break;
-          }
-          tries += 1;
-          // get the distribution from the apprentice
-          auto dist = cur->apprentice.action_dist(this->state);
-          // sample from the distribution tensor with libtorch
-          at::Tensor tmp = torch::multinomial(dist, 1, true)[0];
-          auto sample = tmp.item<int>();
-
-          // convert the index into a move
-
-          // FIXME: this is hardcoded. it would be nicer if we could actually just roll
-          // this into the apprentice somehow, with a sample method that returns an
-          // action.
-          int src = sample / 64;
-          int tgt = sample % 64;
-
-          // create a string representation of the move
-          std::string move = "";
-          move += (char)(src % 8 + 'a');
-          move += (char)(src / 8 + '1');
-          move += (char)(tgt % 8 + 'a');
-          move += (char)(tgt / 8 + '1');
-
-          // re-sample if move isn't legal
-          if (std::find(legal_moves.begin(), legal_moves.end(), move) == legal_moves.end()) {
-            continue;
-          }
-
-          // make the child that would result from playing `move`
-          cur = new ExItNode<S,A>(cur->mdp, cur->apprentice, mdp.tr(cur->state, move), std::vector<ExItNode<S,A>*>(), cur);
-          rollout_nodes.push_back(cur);
-          break;
-        }
+        // sample from the apprentice's policy over the legal moves only, so no
+        // draw is ever wasted on an illegal move; uniform without a policy
+        auto weights = ctx->apprentice.priors ? ctx->apprentice.priors(state, legal_moves) : std::vector<double>();
+        ctx->mdp.play(state, legal_moves[select_weighted(thread_rng(), weights, legal_moves.size())]);
+        step = ctx->mdp.step(state);
+        plies += 1;
       }
-      return rollout_nodes;
+      return terminal_reward(step.reward, plies);
     }
 
-    inline std::vector<ExItNode<S, A>*> basic_rollout() {
-      // ROLLOUT
-      std::vector<ExItNode<S, A>*> rollout_nodes; // nodes to be freed by caller
-      ExItNode* cur = this;
-      while (!mdp.is_terminal(cur->state)) {
-        auto actions = mdp.actions(cur->state);
-        if (actions.size() == 0) {
+    inline double basic_rollout(S state, Step<A> step, int max_plies = std::numeric_limits<int>::max()) {
+      int plies = 0;
+      auto& rng = thread_rng();
+      while (!step.terminal) {
+        if (plies == max_plies) {
+          return value_reward(state, plies);
+        }
+        if (step.actions.size() == 0) {
            throw std::runtime_error("[ERROR]: no actions available at non-terminal state");
         }
-        auto action = select_randomly(g, actions);
-        cur = new ExItNode<S,A>(cur, mdp.tr(cur->state, action));
-        rollout_nodes.push_back(cur);
+        ctx->mdp.play(state, select_randomly(rng, step.actions));
+        step = ctx->mdp.step(state);
+        plies += 1;
       }
-      return rollout_nodes;
+      return terminal_reward(step.reward, plies);
     }
 
-  // search for iters iterations, starting from start
-  // exploration_bias is the exploration term in the UCB1 formula
-  // apprentice is what it sounds like. FIXME: better comment here.
-  A search(int iters, float exploration_bias, bool bootstrap) {
-    if (mdp.actions(this->state).size() == 0) {
-      throw std::runtime_error("[ERROR]: search called on state we can't act in");
+    // `reward` at a terminal state `plies` moves below this node, as seen from this node
+    static inline double terminal_reward(double reward, int plies) {
+      return plies % 2 == 0 ? reward : -reward;
     }
-    for (auto cur_itersm1 = 0; cur_itersm1 < iters; cur_itersm1++) {
-      ExItNode<S,A>* cur = this;
 
-      // SELECTION
-      // std::cout << "selecting..." << std::endl;
-      while (!cur->is_leaf()) {
-        cur = cur->select(cur_itersm1, exploration_bias, bootstrap).value(); // FIXME?: unsafe? what if select returns a nullopt?
+    // the apprentice's estimate of the reward at `state`, `plies` moves below
+    // this node, as seen from this node
+    inline double value_reward(const S& state, int plies) {
+      auto v = ctx->apprentice.eval(state);
+      return plies % 2 == 0 ? v : -v;
+    }
+
+    // Scores this node, a leaf with non-terminal `state` (whose step() is
+    // `step`), as `leaf` says. `cached` means expand() already stored the
+    // apprentice's value here.
+    inline double evaluate_leaf(const S& state, Step<A> step, bool bootstrap, const LeafEval& leaf, bool cached) {
+      if (leaf.mode == LeafEval::Rollout) {
+        return bootstrap ? basic_rollout(state, std::move(step)) : dm_rollout(state, std::move(step));
       }
+      auto v = cached ? (double)this->value : value_reward(state, 0);
+      if (leaf.mode == LeafEval::Value) {
+        return v;
+      }
+      auto z = bootstrap ? basic_rollout(state, std::move(step), leaf.rollout_plies) : dm_rollout(state, std::move(step), leaf.rollout_plies);
+      return (1.0 - leaf.mix) * v + leaf.mix * z;
+    }
+
+  // One selection/expansion/rollout/backprop pass from this node, whose state
+  // is `root_state`. With a non-zero `virtual_loss` several threads can run
+  // iterations on the same tree at once. Returns how many plies below this
+  // node the playout left the tree.
+  inline int iterate(const S& root_state, int cur_itersm1, float exploration_bias, bool bootstrap, Selection selection, const LeafEval& leaf, int virtual_loss) {
+    ExItNode<S,A>* cur = this;
+    S state = root_state;
+    int depth = 0;
+
+    // SELECTION
+    // std::cout << "selecting..." << std::endl;
+    while (!cur->is_leaf()) {
+      cur = cur->select(cur_itersm1, exploration_bias, bootstrap, selection).value(); // FIXME?: unsafe? what if select returns a nullopt?
+      if (virtual_loss != 0) {
+        cur->add_virtual_loss(virtual_loss);
+      }
+      ctx->mdp.play(state, cur->action);
+      depth++;
+    }
 
+    // a leaf some earlier playout found terminal needs no move generation
+    double reward;
+    if (cur->terminal.load(std::memory_order_acquire)) {
+      reward = cur->outcome.load(std::memory_order_relaxed);
+    } else {
       // std::cout << "expanding..." << std::endl;
       // EXPANSION
-      if (!mdp.is_terminal(cur->state)) {
-        auto expanded_child = cur->expand();
-        cur = expanded_child;
+      auto step = ctx->mdp.step(state);
+      bool cached = false; // whether cur->value is the apprentice's value of `state`
+      if (!step.terminal) {
+        auto next = cur->expand(state, step.actions, bootstrap, selection, exploration_bias);
+        if (next == cur) {
+          // PUCT valued `cur` along with its children's priors
+          cached = true;
+        } else if (next != nullptr) {
+          cur = next;
+          if (virtual_loss != 0) {
+            cur->add_virtual_loss(virtual_loss);
+          }
+          ctx->mdp.play(state, cur->action);
+          depth++;
+          step = ctx->mdp.step(state);
+          cached = !bootstrap;
+        } else {
+          // another thread is expanding `cur`, so evaluate `cur` itself; below
+          // the search root a non-bootstrap UCT expansion cached its value
+          cached = !bootstrap && selection == Selection::UCT && cur != this;
+        }
       }
 
-      // ROLLOUT
-      std::vector<ExItNode*> rollout_nodes;
-      if (!mdp.is_terminal(cur->state)) {
-        rollout_nodes = bootstrap ? cur->basic_rollout() : cur->dm_rollout();
-        cur = rollout_nodes.back();
+      // ROLLOUT (or whatever else `leaf` asks for)
+      if (step.terminal) {
+        cur->set_terminal(step.reward);
+        reward = step.reward;
+      } else {
+        reward = cur->evaluate_leaf(state, std::move(step), bootstrap, leaf, cached);
       }
+    }
 
-      // std::cout << "backpropagating..." << std::endl;
-      // BACKPROPAGATION
-      cur->backprop();
-      // free the rollout nodes
-      for (auto node : rollout_nodes) {
-        delete node;
-      }
+    // std::cout << "backpropagating..." << std::endl;
+    // BACKPROPAGATION
+    cur->backprop(reward, this, virtual_loss);
+    return depth;
+  }
+
+  // Whether a search from this node that has run `iters_done` iterations
+  // should end. The first iteration always runs, so there's a move to return.
+  bool search_done(const SearchLimits& limits, int iters_done) {
+    if (iters_done == 0) {
+      return false;
+    }
+    if (iters_done >= limits.iters || limits.stopped() || limits.expired()) {
+      return true;
+    }
+    if (limits.depth > 0 && limits.depth_reached.load(std::memory_order_relaxed) >= limits.depth) {
+      return true;
     }
+    // looking at every root child each iteration would cost more than it saves
+    return limits.early_stop && iters_done % 32 == 0 && decided(limits.remaining(iters_done));
+  }
 
-    // return the action resulting in the child with the highest expected value
-    auto actions = mdp.actions(this->state);
-    auto ret = argmax(actions.begin(), actions.end(), [&,this](auto action) {
-      auto child = std::find_if(this->children.begin(), this->children.end(),[&,this](auto child){ return child->state == this->mdp.tr(this->state, action); });
-      if (child == this->children.end()) {
-        std::cout << "[ERROR]: no child found for action: " << action << std::endl;
-        std::cout << "state is_terminal: " << mdp.is_terminal(this->state) << std::endl;
-        // std::cout << "children " << "(" << this->children.size() << "): " << this->children << std::endl;
-        // std::cout << "actions " << "(" << actions.size() << "): " << actions << std::endl;
-        throw std::runtime_error("[ERROR]: no child found for action");
-      }
-      return (*child)->expected.value_or(-std::numeric_limits<double>::infinity()); // we never pick an unexplored child
+  // Whether best_action() is settled: with rewards in [-1, 1], even if the
+  // current best child lost all of the `remaining` iterations and any other
+  // child won them all, the best child's mean would still be ahead.
+  bool decided(long remaining) {
+    if (is_leaf() || children.size() < 2) {
+      return !is_leaf();
+    }
+    auto best = *argmax(children.begin(), children.end(), [](ExItNode<S,A>* child) {
+      return child->expected().value_or(-std::numeric_limits<double>::infinity());
     });
+    auto worst_case = (best->tot.load() - remaining) / (best->count.load() + remaining);
+    for (auto child : children) {
+      if (child != best && (child->tot.load() + remaining) / (child->count.load() + remaining) >= worst_case) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-    if (ret == actions.end()) {
-      throw std::runtime_error("[ERROR]: no actions available at non-terminal state");
+  // search from this node, whose state is `root_state`, until `limits` says
+  // to stop; exploration_bias is the exploration term in the UCB1 formula
+  A search(const S& root_state, const SearchLimits& limits, float exploration_bias, bool bootstrap, Selection selection = Selection::UCT, const LeafEval& leaf = LeafEval()) {
+    if (ctx->mdp.actions(root_state).size() == 0) {
+      throw std::runtime_error("[ERROR]: search called on state we can't act in");
+    }
+    for (auto cur_itersm1 = 0; !search_done(limits, cur_itersm1); cur_itersm1++) {
+      limits.note_depth(iterate(root_state, cur_itersm1, exploration_bias, bootstrap, selection, leaf, 0));
     }
 
-    auto child = *std::find_if(this->children.begin(), this->children.end(), [&,this](auto child){ return child->state == this->mdp.tr(this->state, *ret); });
-    return *ret;
+    // return the action resulting in the child with the highest expected value
+    return best_action();
   };
 
-  // root-parallel search
-  A par_search(int iters, float exploration_bias, bool bootstrap) {
-    // assert (!this->mdp.is_terminal(this->state));
-    auto num_threads = std::thread::hardware_concurrency();
-    auto num_iters_per_thread = iters / num_threads;
-    auto num_iters_last_thread = iters - (num_threads - 1) * num_iters_per_thread;
-
-    auto threads = std::vector<std::thread>();
-    std::mutex trees_m;
-    auto trees = std::vector<ExItNode<S,A>*>();
-    for (auto i = 0; i < num_threads; i++) {
-      auto num_iters = i == num_threads - 1 ? num_iters_last_thread : num_iters_per_thread;
-      threads.push_back(std::thread([=, &trees_m, &trees,this]() {
-        ExItNode<S,A> *copy = new ExItNode<S,A>(*this, this->parent);
-        copy->search(num_iters, exploration_bias, bootstrap);
-        trees_m.lock();
-        trees.push_back(copy);
-        trees_m.unlock();
-      }));
+  // tree-parallel search: every worker of `pool` runs iterations on this tree
+  // at the same time, kept apart by virtual loss.
+  A tree_par_search(const S& root_state, const SearchLimits& limits, float exploration_bias, bool bootstrap, ThreadPool& pool, int virtual_loss = 3, Selection selection = Selection::UCT, const LeafEval& leaf = LeafEval()) {
+    if (ctx->mdp.actions(root_state).size() == 0) {
+      throw std::runtime_error("[ERROR]: search called on state we can't act in");
     }
+    std::atomic<int> next_iter = 0;
+    ctx->tree()->set_shared(true);
+    pool.run(pool.size(), [&, this](size_t) {
+      for (int cur_itersm1 = next_iter++; !search_done(limits, cur_itersm1); cur_itersm1 = next_iter++) {
+        limits.note_depth(iterate(root_state, cur_itersm1, exploration_bias, bootstrap, selection, leaf, virtual_loss));
+      }
+    });
+    ctx->tree()->set_shared(false);
 
-    for (auto& thread : threads) {
-      thread.join();
-    }
+    // return the action resulting in the child with the highest expected value
+    return best_action();
+  };
 
-    ExItNode<S,A> *tree = trees[0];
-    for (auto i = 1; i < trees.size(); i++) {
-      tree->merge(trees[i]);
+  // root-parallel search on the workers of `pool`. Worker 0 searches this
+  // tree in place, the others grow fresh trees in contexts of their own; the
+  // trees are then merged pairwise in parallel, `merge_depth` plies deep.
+  //
+  // With `stats_plies` > 0 the other workers instead report only the
+  // statistics of the root and `stats_plies` plies below it (1 is enough to
+  // pick a move, 2 keeps something for the next search) and free their trees
+  // as soon as they finish; the host adds the reports into this tree.
+  A par_search(const S& root_state, const SearchLimits& limits, float exploration_bias, bool bootstrap, ThreadPool& pool, int merge_depth = std::numeric_limits<int>::max(), int stats_plies = 0, Selection selection = Selection::UCT, const LeafEval& leaf = LeafEval()) {
+    // assert (!ctx->mdp.is_terminal(root_state));
+    auto num_threads = pool.size();
+    auto num_iters_per_thread = limits.iters / num_threads;
+    auto num_iters_last_thread = limits.iters - (num_threads - 1) * num_iters_per_thread;
+
+    auto contexts = std::vector<std::unique_ptr<SearchContext<S,A>>>(num_threads);
+    auto trees = std::vector<ExItNode<S,A>*>(num_threads);
+    trees[0] = this;
+    for (size_t i = 1; i < num_threads; i++) {
+      contexts[i] = std::make_unique<SearchContext<S,A>>(ctx->mdp, ctx->apprentice);
+      trees[i] = contexts[i]->new_node(contexts[i].get(), std::nullopt);
     }
+    auto summaries = std::vector<Summary>(num_threads);
+    auto search_no = ++ctx->tree()->searches;
+    pool.run(num_threads, [&](size_t i) {
+      set_rng_stream((search_no << 32) | (i + 1));
+      // every worker checks the shared limits against its own tree and share
+      auto worker_limits = limits;
+      worker_limits.iters = i == num_threads - 1 ? num_iters_last_thread : num_iters_per_thread;
+      if (worker_limits.iters > 0) {
+        trees[i]->search(root_state, worker_limits, exploration_bias, bootstrap, selection, leaf);
+      }
+      if (stats_plies > 0 && i > 0) {
+        summaries[i] = trees[i]->summarize(stats_plies);
+        contexts[i].reset();
+      }
+    });
 
-    for (auto child : this->children) {
-      delete child;
+    if (stats_plies > 0) {
+      for (size_t i = 1; i < num_threads; i++) {
+        this->absorb(summaries[i]);
+      }
+      return best_action();
     }
-    *this = *new ExItNode<S,A>(*tree, tree->parent);
 
-    for (auto tree : trees) {
-      delete tree;
+    // binary reduction: in the round with stride `step`, tree i takes in tree
+    // i + step. A merge only writes to nodes of the receiving tree's half, so
+    // the merges of one round don't touch each other's nodes or arenas.
+    for (size_t step = 1; step < num_threads; step *= 2) {
+      auto receivers = std::vector<size_t>();
+      for (size_t i = 0; i + step < num_threads; i += 2 * step) {
+        receivers.push_back(i);
+      }
+      pool.run(receivers.size(), [&](size_t k) {
+        auto i = receivers[k];
+        trees[i]->merge(trees[i + step], merge_depth);
+      });
+    }
+    for (size_t i = 1; i < num_threads; i++) {
+      ctx->tree()->adopt(std::move(contexts[i]));
     }
 
     // return the action resulting in the child with the highest expected value
-    auto actions = mdp.actions(this->state);
-    auto ret = *argmax(actions.begin(), actions.end(), [&,this](auto action) {
-      auto child = std::find_if(this->children.begin(), this->children.end(), [&,this](auto child){ return child->state == this->mdp.tr(this->state, action); });
-      if (child == this->children.end()) {
-        std::cout << "[ERROR]: no child found for action" << std::endl;
-        std::cout << "state is_terminal: " << mdp.is_terminal(this->state) << std::endl;
-        throw std::runtime_error("[ERROR]: no child found for action");
-      }
-      return (*child)->expected.value_or(-std::numeric_limits<double>::infinity()); // we never pick an unexplored child
-    });
-
-    auto child = *std::find_if(this->children.begin(), this->children.end(), [&,this](auto child){ return child->state == this->mdp.tr(this->state, ret); });
-    return ret;
+    return best_action();
   };
 };
 
+// Tree-parallel scaling benchmark. Searches a few fixed positions with 1 to
+// `max_threads` threads and reports playouts per second and how often the
+// chosen move agrees with the move picked most often by the single-threaded
+// runs. Uses random rollouts (bootstrap) so the apprentice isn't involved.
+void bench_tree_parallel(MDP<bb::Position, thc::Move> mdp, Apprentice<bb::Position, thc::Move> apprentice, int iters, int max_threads) {
+  auto lines = std::vector<std::vector<std::string>>{
+    {},
+    {"e2e4", "e7e5", "g1f3", "b8c6", "f1b5"},
+    {"d2d4", "d7d5", "c2c4", "e7e6", "b1c3", "g8f6"},
+  };
+  const int reps = 3;
+  SearchContext<bb::Position, thc::Move> ctx(mdp, apprentice);
+  ThreadPool pool(1);
+  auto reference = std::vector<thc::Move>(lines.size());
+  double base_rate = 0.0;
+  for (int num_threads = 1; num_threads <= max_threads; num_threads++) {
+    pool.resize(num_threads);
+    int agree = 0;
+    long playouts = 0;
+    double seconds = 0.0;
+    for (size_t i = 0; i < lines.size(); i++) {
+      thc::ChessRules board;
+      for (auto mv : lines[i]) {
+        board.PlayMove(str_to_move(board, mv));
+      }
+      auto moves = std::vector<thc::Move>();
+      for (int rep = 0; rep < reps; rep++) {
+        ctx.reset();
+        auto root = ctx.new_node(&ctx, std::nullopt);
+        auto start = std::chrono::steady_clock::now();
+        moves.push_back(root->tree_par_search(bb::Position(board), iters, 0.5, true, pool));
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        playouts += root->count.load();
+      }
+      if (num_threads == 1) {
+        reference[i] = *argmax(moves.begin(), moves.end(), [&](const thc::Move& mv) {
+          return std::count(moves.begin(), moves.end(), mv);
+        });
+      }
+      agree += std::count(moves.begin(), moves.end(), reference[i]);
+    }
+    double rate = playouts / seconds;
+    if (num_threads == 1) {
+      base_rate = rate;
+    }
+    printf("threads %d playouts/s %.1f speedup %.2f agreement %.2f\n", num_threads, rate, rate / base_rate, (double)agree / (lines.size() * reps));
+  }
+}
+
 int uci_chess() {
   // make a transition function pointer that takes a position and a move and returns a new position
   // this is a lambda function that takes a position and a move and returns a new position
-  thc::ChessRules (*tr)(thc::ChessRules s, std::string a) = [](thc::ChessRules cr, std::string mv) {
-    auto new_board = thc::ChessRules(cr);
-    // assert(get_legal_moves(new_board) == get_legal_moves(cr));
-    new_board.PlayMove(str_to_move(cr, mv));
-    return new_board;
+  // The search plays on bitboard positions (bitboard.h); thc::ChessRules
+  // only parses and prints moves and keeps the game record. Actions are
+  // thc's moves, converted at the edges, so they compare equal to moves
+  // parsed from UCI and no string is involved.
+  bb::Position (*tr)(bb::Position s, thc::Move a) = [](bb::Position pos, thc::Move mv) {
+    pos.play(bb::Position::from_thc(mv));
+    return pos;
   };
 
-  std::vector<std::string> (*actions)(thc::ChessRules s) = [](thc::ChessRules cr) {
-    std::vector<std::string> moves = std::vector<std::string>();
-    for (auto mv : get_legal_moves(cr)) {
-      moves.push_back(move_to_str(cr, mv));
+  std::vector<thc::Move> (*actions)(bb::Position s) = [](bb::Position pos) {
+    bb::MoveList list;
+    pos.legal_moves(list);
+    auto moves = std::vector<thc::Move>(list.count);
+    for (int i = 0; i < list.count; i++) {
+      moves[i] = pos.to_thc(list.moves[i]);
     }
     return moves;
   };
 
-  std::optional<double> (*reward)(thc::ChessRules s) = [](thc::ChessRules cr) {
-    thc::TERMINAL eval;
-    cr.Evaluate(eval);
-    if (eval == thc::TERMINAL_WCHECKMATE) { // White is checkmated
-      if (cr.white) {
-        return std::optional(-1.0);
-      } else {
-        return std::optional(1.0);
-      }
-    } else if (eval == thc::TERMINAL_BCHECKMATE) { // Black is checkmated
-      if (!cr.white) {
-        return std::optional(-1.0);
-      } else {
-        return std::optional(1.0);
-      }
-    } else {
-      return std::optional(0.0);
+  // -1 for the side to move when it's checkmated, 0 otherwise
+  std::optional<double> (*reward)(bb::Position s) = [](bb::Position pos) {
+    bb::MoveList list;
+    pos.legal_moves(list);
+    return std::optional(list.count == 0 && pos.in_check() ? -1.0 : 0.0);
+  };
+
+  // mate, stalemate, or a draw by the 50 move rule or material
+  bool (*is_terminal)(bb::Position s) = [](bb::Position pos) {
+    bb::MoveList list;
+    pos.legal_moves(list);
+    return list.count == 0 || pos.is_draw();
+  };
+
+  void (*play)(bb::Position& s, thc::Move a) = [](bb::Position& pos, thc::Move mv) {
+    pos.play(bb::Position::from_thc(mv));
+  };
+
+  // all three of the above from a single move generation, which is what the
+  // search calls once per ply
+  Step<thc::Move> (*step)(const bb::Position& s) = [](const bb::Position& pos) {
+    bb::MoveList list;
+    pos.legal_moves(list);
+    if (list.count == 0 || pos.is_draw()) {
+      return Step<thc::Move>{{}, true, list.count == 0 && pos.in_check() ? -1.0 : 0.0};
+    }
+    auto moves = std::vector<thc::Move>(list.count);
+    for (int i = 0; i < list.count; i++) {
+      moves[i] = pos.to_thc(list.moves[i]);
     }
+    return Step<thc::Move>{std::move(moves), false, 0.0};
   };
 
-  auto mdp = MDP<thc::ChessRules, std::string>(tr, reward, actions, board_is_terminal);
+  auto mdp = MDP<bb::Position, thc::Move>(tr, reward, actions, is_terminal, play, step);
   int stalemates = 0;
   int wins = 0;
   int losses = 0;
+  // Each search thread keeps a core busy, so by default libtorch gets one
+  // thread of its own for the network (`IntraOpThreads`).
+  torch::set_num_threads(1);
   // if apprentice.pt exists, load it into `model` using torch::load
   torch::jit::script::Module model;
   if (std::filesystem::exists("apprentice.pt")) {
     try {
-        model = torch::jit::load("apprentice.pt");
+        model = torch::jit::load("apprentice.pt", torch::kCPU);
     } catch (const c10::Error &error) {
         std::cerr << error.what() << std::endl;  
         std::cerr << "Error loading the model" << std::endl;
@@ -480,59 +954,231 @@ int uci_chess() {
     return -1;
   }
 
-  std::cout << "cuda is available: " << (torch::cuda::is_available() ? "yes" : "no") << std::endl;
-  model.to(torch::kCUDA);
-  auto evalf = [&model](thc::ChessRules state) { return model.forward({board_to_tensor(state).to(torch::kCUDA).view({1,119,8,8})}).toTensor()[-1].item<double>(); };
-  auto trainf = [&model](std::vector<thc::ChessRules> states, std::vector<std::string> actions, double reward) {
+  // runs on the CPU unless `setoption name Device` says otherwise
+  ModelBackend backend(std::move(model), {board_planes, 8, 8});
+  // Search-time evaluations from all threads go through one batching queue;
+  // its clients are the search threads.
+  size_t batch_size = 64;
+  auto batch_timeout = std::chrono::microseconds(200);
+  InferenceQueue inference([&backend](torch::Tensor batch) {
+    return backend.forward(batch);
+  }, {board_planes, 8, 8}, batch_size, batch_timeout, std::thread::hardware_concurrency());
+  // positions are encoded straight into the queue's batch; the caller waits
+  // for the result, so the encoder can hold on to the position by reference
+  auto encoder = [](const bb::Position& state) {
+    return [&state](float* out) { encode_board(state, out); };
+  };
+  auto evalf = [&inference, encoder](bb::Position state) { return inference.evaluate(encoder(state))[-1].item<double>(); };
+  auto trainf = [&backend](std::vector<bb::Position> states, std::vector<thc::Move> actions, double reward) {
     // trains on the results from a single step of self-play
+    auto device = backend.device();
     int parity = 1;
     for (int i = 0; i < states.size()-1; i++) {
       auto loss = torch::nn::MSELoss();
-      torch::Tensor output = model.forward({board_to_tensor(states[i]).to(torch::kCUDA).view({1,119,8,8})}).toTensor().to(torch::kCUDA);
+      torch::Tensor output = backend.model.forward({board_to_tensor(states[i]).to(device).view({1,119,8,8})}).toTensor().view({-1});
 
       // convert the action to a tensor
-      torch::Tensor action_tensor = torch::zeros({4096}).to(torch::kCUDA);
-
-      // action[i] is a string representing the chess move taken at states[i],
-      // we need to convert it to a pair of indices ((i1,j1),(i2,j2)) indicating
-      // the source and target of the move.
-      auto src_str = actions[i].substr(0,2);
-      auto dst_str = actions[i].substr(2,2);
-      auto src = std::make_pair(src_str[0]-'a', src_str[1]-'1');
-      auto dst = std::make_pair(dst_str[0]-'a', dst_str[1]-'1');
-      action_tensor[src.first*src.second * dst.first*dst.second] = 1;
-
-      std::vector<torch::Tensor> tgt = {action_tensor,torch::tensor({reward*parity}).to(torch::kCUDA)};
-      auto target = torch::cat(tgt, 0).to(torch::kCUDA);
-      auto l = loss(output, target).to(torch::kCUDA);
+      torch::Tensor action_tensor = torch::zeros({4096}).to(device);
+
+      action_tensor[policy_index(actions[i])] = 1;
+
+      std::vector<torch::Tensor> tgt = {action_tensor,torch::tensor({reward*parity}).to(device)};
+      auto target = torch::cat(tgt, 0);
+      auto l = loss(output, target);
       l.backward();
       std::vector<torch::Tensor> parameters;
-      for (auto parameter : model.parameters()) {
-        parameters.push_back(parameter.to(torch::kCUDA));
+      for (auto parameter : backend.model.parameters()) {
+        parameters.push_back(parameter);
       }
       torch::optim::SGD(parameters, 0.01).step();
       torch::optim::SGD(parameters, 0.01).zero_grad();
       parity *= -1;
     }
+    // the search evaluates with the trained weights from here on
+    backend.refresh();
   };
-  auto action_dist = [&model](thc::ChessRules state) {
-    torch::Tensor fwd_tensor = model.forward({board_to_tensor(state).to(torch::kCUDA).view({1,119,8,8})}).toTensor().to(torch::kCUDA);
-    return fwd_tensor.slice(0, 0, fwd_tensor.size(0) - 1);
+  // all children of an expanding node go into the queue together, so even a
+  // single search thread fills batches
+  auto eval_many = [&inference, encoder](std::vector<bb::Position> states) {
+    auto pending = std::vector<std::future<torch::Tensor>>();
+    pending.reserve(states.size());
+    for (auto& state : states) {
+      pending.push_back(inference.submit(encoder(state)));
+    }
+    auto values = std::vector<double>();
+    values.reserve(states.size());
+    for (auto& result : pending) {
+      values.push_back(inference.wait(result)[-1].item<double>());
+    }
+    return values;
+  };
+  // the policy head's probabilities of the legal moves (the search
+  // renormalises them over the legal moves)
+  auto priors = [&inference, encoder](bb::Position state, std::vector<thc::Move> moves) {
+    auto out = inference.evaluate(encoder(state)).to(torch::kCPU).to(torch::kFloat32).contiguous();
+    auto dist = out.data_ptr<float>();
+    auto p = std::vector<double>(moves.size());
+    for (size_t i = 0; i < moves.size(); i++) {
+      p[i] = dist[policy_index(moves[i])];
+    }
+    return p;
+  };
+  // priors and value from the same forward pass, for PUCT expansions
+  auto predict = [&inference, encoder](bb::Position state, std::vector<thc::Move> moves) {
+    auto out = inference.evaluate(encoder(state)).to(torch::kCPU).to(torch::kFloat32).contiguous();
+    auto dist = out.data_ptr<float>();
+    auto p = std::vector<double>(moves.size());
+    for (size_t i = 0; i < moves.size(); i++) {
+      p[i] = dist[policy_index(moves[i])];
+    }
+    return Prediction{p, dist[out.numel() - 1]};
+  };
+  auto apprentice = Apprentice<bb::Position, thc::Move>(evalf, trainf, eval_many, priors, predict);
+  // the whole game tree lives in `ctx` (and the contexts it adopted from
+  // root-parallel workers); starting a new tree just resets it
+  auto ctx = std::make_unique<SearchContext<bb::Position, thc::Move>>(mdp, apprentice);
+  auto new_root = [&]() {
+    ctx->reset();
+    return ctx->new_node(ctx.get(), std::nullopt);
   };
-  auto apprentice = Apprentice<thc::ChessRules, std::string>(action_dist, evalf, trainf);
-  auto root = std::make_unique<ExItNode<thc::ChessRules, std::string>>(mdp, apprentice, thc::ChessRules(), std::vector<ExItNode<thc::ChessRules, std::string>*>(), std::nullopt);
-  
-  auto cur_node = root.get();
-  auto played = std::vector<std::string>();
+  auto root = new_root();
+
+  auto cur_node = root;
+  // moves from the start position to `cur_node`, so `position` can tell
+  // whether it continues the game the tree was built for; nullopt if unknown
+  auto tree_line = std::optional<std::vector<thc::Move>>(std::vector<thc::Move>());
+
+  // Makes `node` the root of a tree of its own: its subtree is copied into a
+  // fresh context and the old tree, with every sibling we've moved past, is
+  // freed on the reaper thread so `position` doesn't wait for it.
+  std::thread reaper;
+  auto promote = [&](ExItNode<bb::Position, thc::Move>* node) {
+    auto fresh = std::make_unique<SearchContext<bb::Position, thc::Move>>(mdp, apprentice);
+    auto new_root = fresh->new_node(*node, std::nullopt, fresh.get());
+    if (reaper.joinable()) {
+      reaper.join();
+    }
+    reaper = std::thread([old = std::move(ctx)]() mutable { old.reset(); });
+    ctx = std::move(fresh);
+    return new_root;
+  };
+
+  // search workers live for the whole session; `setoption name Threads` resizes them
+  ThreadPool pool(std::thread::hardware_concurrency());
+  bool pin_threads = false;
+
+  // root-parallel (independent trees, merged) or tree-parallel (one shared tree)
+  bool tree_parallel = false;
+  // plies of the worker trees merged by root-parallel search; 0 merges all of them
+  int merge_depth = 0;
+  // plies of statistics root-parallel workers report instead of merging whole trees; 0 merges trees
+  int stats_plies = 0;
+  // UCT with the 0.5 exploration bias we've always used, or PUCT with `c_puct`
+  auto selection = Selection::UCT;
+  float c_puct = 1.5;
+  auto leaf_eval = LeafEval();
+  auto run_search = [&](ExItNode<bb::Position, thc::Move>* node, const bb::Position& state, const SearchLimits& limits = SearchLimits(800)) {
+    auto exploration_bias = selection == Selection::PUCT ? c_puct : 0.5f;
+    if (tree_parallel) {
+      return node->tree_par_search(state, limits, exploration_bias, false, pool, 3, selection, leaf_eval);
+    }
+    return node->par_search(state, limits, exploration_bias, false, pool, merge_depth > 0 ? merge_depth : std::numeric_limits<int>::max(), stats_plies, selection, leaf_eval);
+  };
+  // milliseconds held back from every move for GUI and network latency
+  long move_overhead = 50;
+  // Budget for `go` with the arguments in `toks`. Without any that bound the
+  // search (our clock, movetime, nodes or depth) it's the old fixed 800
+  // iterations; clock arguments give a deadline from allocate_time(). Finite
+  // searches stop early once the move is settled.
+  auto go_limits = [&](const std::vector<std::string>& toks, bool white) {
+    auto limits = SearchLimits();
+    std::optional<long> time_left, movetime;
+    std::optional<int> moves_to_go;
+    long increment = 0;
+    bool limited = false; // by nodes or depth
+    for (size_t i = 1; i + 1 < toks.size(); i++) {
+      auto& arg = toks[i];
+      auto& val = toks[i + 1];
+      if (arg == (white ? "wtime" : "btime")) {
+        time_left = std::stol(val);
+      } else if (arg == (white ? "winc" : "binc")) {
+        increment = std::stol(val);
+      } else if (arg == "movestogo") {
+        moves_to_go = std::stoi(val);
+      } else if (arg == "movetime") {
+        movetime = std::stol(val);
+      } else if (arg == "nodes") {
+        limits.iters = std::max(std::stoi(val), 1);
+        limited = true;
+      } else if (arg == "depth") {
+        limits.depth = std::max(std::stoi(val), 1);
+        limited = true;
+      }
+    }
+    // increments or movestogo without our clock don't bound anything
+    if (auto budget = allocate_time(time_left, increment, moves_to_go, movetime, move_overhead)) {
+      limits.deadline = limits.start + std::chrono::milliseconds(*budget);
+    } else if (!limited) {
+      limits.iters = 800;
+    }
+    limits.early_stop = true;
+    return limits;
+  };
+  auto played = std::vector<thc::Move>();
     // create a new board (initial position
   thc::ChessRules board = thc::ChessRules(); 
+  // `board` again, reached by playing the game's moves so the search sees
+  // repetitions of positions from before its root
+  bb::Position game;
   auto num_turns = 0;
   std::string best_move_str;
 
+  // `go` searches on a thread of its own so that `stop`, `ponderhit` and
+  // `quit` are read while it runs. `go infinite` and `go ponder` search until
+  // told otherwise; a pondering search doesn't report its move, and
+  // `ponderhit` replaces it with a normal search of the same (by then
+  // warmed-up) tree.
+  std::thread searcher;
+  std::atomic<bool> stop_search = false;
+  std::atomic<bool> report_bestmove = false;
+  bool pondering = false;
+  bool unbounded = false; // the running search only ends when told to
+  std::mutex out_m; // the searcher and the command loop both write to stdout
+  std::vector<std::string> ponder_go; // the `go ponder` command, for its clock arguments
+  auto start_search = [&](SearchLimits limits, bool report) {
+    stop_search = false;
+    report_bestmove = report;
+    unbounded = limits.iters == std::numeric_limits<int>::max() && !limits.deadline.has_value() && limits.depth == 0;
+    limits.stop = &stop_search;
+    searcher = std::thread([&, limits, node = cur_node, state = game]() {
+      auto best = run_search(node, state, limits);
+      if (report_bestmove) {
+        std::lock_guard<std::mutex> lock(out_m);
+        if (inference.stats().batches > 0) {
+          std::cout << "info string " << inference.report() << std::endl;
+        }
+        best_move_str = best.TerseOut();
+        std::cout << "bestmove " << best_move_str << std::endl;
+      }
+      inference.reset_stats();
+    });
+  };
+  // stops the running search, if any, and waits for it to report (or not)
+  auto finish_search = [&](bool report) {
+    if (searcher.joinable()) {
+      report_bestmove = report;
+      stop_search = true;
+      searcher.join();
+    }
+    pondering = false;
+  };
+
   // read `uci` command in from stdin and respond
   for (;;) {
     std::string cmd;
-    std::getline(std::cin, cmd);
+    if (!std::getline(std::cin, cmd)) {
+      cmd = "quit";
+    }
     auto toks = std::vector<std::string>();
     std::string cur = "";
     for (auto c : cmd) {
@@ -547,21 +1193,124 @@ int uci_chess() {
     if (toks.size() == 0) {
       continue;
     }
+    // only these may arrive while a search is running; anything else waits
+    // for a bounded search to report, or quietly ends an unbounded one
+    if (toks[0] != "stop" && toks[0] != "ponderhit" && toks[0] != "isready" && toks[0] != "quit") {
+      if (unbounded) {
+        finish_search(false);
+      } else if (searcher.joinable()) {
+        searcher.join();
+      }
+    }
     if (toks[0] == "uci") {
       std::cout << "id name " << "jaybot9000" << std::endl;
       std::cout << "id author " << "jay" << std::endl;
+      std::cout << "option name Threads type spin default " << std::thread::hardware_concurrency() << " min 1 max 1024" << std::endl;
+      std::cout << "option name PinThreads type check default false" << std::endl;
+      std::cout << "option name ParallelMode type combo default root var root var tree" << std::endl;
+      std::cout << "option name MergeDepth type spin default 0 min 0 max 1024" << std::endl;
+      std::cout << "option name StatsPlies type spin default 0 min 0 max 1024" << std::endl;
+      std::cout << "option name Seed type string default random" << std::endl;
+      std::cout << "option name MoveOverhead type spin default 50 min 0 max 5000" << std::endl;
+      std::cout << "option name BatchSize type spin default 64 min 1 max 4096" << std::endl;
+      std::cout << "option name Selection type combo default UCT var UCT var PUCT" << std::endl;
+      std::cout << "option name CPuct type string default 1.5" << std::endl;
+      std::cout << "option name LeafEval type combo default rollout var rollout var value var hybrid" << std::endl;
+      std::cout << "option name RolloutPlies type spin default 16 min 0 max 1024" << std::endl;
+      std::cout << "option name RolloutMix type string default 0.5" << std::endl;
+      std::cout << "option name BatchTimeout type spin default 200 min 0 max 100000" << std::endl;
+      std::cout << "option name Device type string default cpu" << std::endl;
+      std::cout << "option name IntraOpThreads type spin default 1 min 1 max 512" << std::endl;
+      std::cout << "option name InterOpThreads type spin default 0 min 0 max 512" << std::endl;
       std::cout << "uciok" << std::endl;
     }
+    if (toks[0] == "setoption" && toks.size() >= 5 && toks[1] == "name" && toks[3] == "value") {
+      if (toks[2] == "Threads") {
+        pool.resize(std::max(std::stoi(toks[4]), 1), pin_threads);
+        inference.configure(batch_size, batch_timeout, pool.size());
+      }
+      if (toks[2] == "BatchSize") {
+        batch_size = std::max(std::stoi(toks[4]), 1);
+        inference.configure(batch_size, batch_timeout, pool.size());
+      }
+      if (toks[2] == "Device") {
+        // e.g. cpu, cuda or cuda:1
+        try {
+          backend.to(torch::Device(toks[4]));
+        } catch (const c10::Error &error) {
+          std::lock_guard<std::mutex> lock(out_m);
+          std::cout << "info string can't use device " << toks[4] << ", staying on " << backend.device().str() << std::endl;
+        }
+      }
+      if (toks[2] == "IntraOpThreads") {
+        torch::set_num_threads(std::max(std::stoi(toks[4]), 1));
+      }
+      // 0 keeps libtorch's own inter-op pool; it only runs anything for
+      // models that fork, so it's left alone unless asked
+      if (toks[2] == "InterOpThreads" && std::stoi(toks[4]) > 0 && !set_interop_threads(std::stoi(toks[4]))) {
+        std::lock_guard<std::mutex> lock(out_m);
+        std::cout << "info string InterOpThreads can only be set before the first search" << std::endl;
+      }
+      if (toks[2] == "BatchTimeout") {
+        batch_timeout = std::chrono::microseconds(std::max(std::stoi(toks[4]), 0));
+        inference.configure(batch_size, batch_timeout, pool.size());
+      }
+      if (toks[2] == "PinThreads") {
+        pin_threads = toks[4] == "true";
+        pool.resize(pool.size(), pin_threads);
+      }
+      if (toks[2] == "ParallelMode") {
+        tree_parallel = toks[4] == "tree";
+      }
+      if (toks[2] == "MergeDepth") {
+        merge_depth = std::max(std::stoi(toks[4]), 0);
+      }
+      if (toks[2] == "Seed" && toks[4] != "random") {
+        // master seed for the search threads' Xoshiro256 streams, which make
+        // every random choice the search and its rollouts take
+        seed_rngs(std::stoull(toks[4]));
+      }
+      if (toks[2] == "Selection") {
+        selection = toks[4] == "PUCT" ? Selection::PUCT : Selection::UCT;
+      }
+      if (toks[2] == "CPuct") {
+        c_puct = std::stof(toks[4]);
+      }
+      if (toks[2] == "LeafEval") {
+        leaf_eval.mode = toks[4] == "value" ? LeafEval::Value : toks[4] == "hybrid" ? LeafEval::Hybrid : LeafEval::Rollout;
+      }
+      if (toks[2] == "RolloutPlies") {
+        leaf_eval.rollout_plies = std::max(std::stoi(toks[4]), 0);
+      }
+      if (toks[2] == "RolloutMix") {
+        leaf_eval.mix = std::stod(toks[4]);
+      }
+      if (toks[2] == "MoveOverhead") {
+        move_overhead = std::max(std::stol(toks[4]), 0L);
+      }
+      if (toks[2] == "StatsPlies") {
+        stats_plies = std::max(std::stoi(toks[4]), 0);
+      }
+    }
+    if (toks[0] == "bench") {
+      // bench [iters] [max threads]
+      int iters = toks.size() >= 2 ? std::stoi(toks[1]) : 800;
+      int max_threads = toks.size() >= 3 ? std::stoi(toks[2]) : std::thread::hardware_concurrency();
+      bench_tree_parallel(mdp, apprentice, iters, max_threads);
+    }
     if (toks[0] == "isready") {
+      std::lock_guard<std::mutex> lock(out_m);
       std::cout << "readyok" << std::endl;
     }
     if (toks[0] == "ucinewgame") {
       // create a new board (initial position)
       board = thc::ChessRules(); 
+      game = bb::Position();
       num_turns = 0;
-      played = std::vector<std::string>();
-      root.reset(new ExItNode<thc::ChessRules, std::string>(mdp, apprentice, thc::ChessRules(), std::vector<ExItNode<thc::ChessRules, std::string>*>(), std::nullopt));
-      cur_node = root.get();
+      played = std::vector<thc::Move>();
+      root = new_root();
+      cur_node = root;
+      tree_line = std::vector<thc::Move>();
     }
     // if cmd matches the regular expression position (pos) (.*)
     if (toks[0] == "position") {
@@ -575,53 +1324,95 @@ int uci_chess() {
 
       if (fen == "startpos") {
         board = thc::ChessRules();
+        game = bb::Position();
       } else {
         throw std::runtime_error("custom fen not supported"); // FIXME: add support for custom FEN
       }
-      root.reset(new ExItNode<thc::ChessRules, std::string>(mdp, apprentice, board, std::vector<ExItNode<thc::ChessRules, std::string>*>(), std::nullopt));
-      std::vector<std::string> played = std::vector<std::string>();
+      // the only place moves are parsed; from here on they're thc::Moves
+      auto line = std::vector<thc::Move>();
       for (auto mv : moves) {
-        board.PlayMove(str_to_move(board, mv));
-        played.push_back(mv);
+        line.push_back(str_to_move(board, mv));
+        board.PlayMove(line.back());
+        game.play(bb::Position::from_thc(line.back()));
       }
-      cur_node = root.get()->play(played);
+      // usually this is the last position plus our move and the reply; if so
+      // keep what the earlier searches learned about it
+      if (tree_line.has_value() && line.size() >= tree_line->size() && std::equal(tree_line->begin(), tree_line->end(), line.begin())) {
+        auto next = std::vector<thc::Move>(line.begin() + tree_line->size(), line.end());
+        if (!next.empty()) {
+          root = promote(cur_node->play(next));
+          cur_node = root;
+        }
+      } else {
+        root = new_root();
+        cur_node = root->play(line);
+      }
+      tree_line = line;
     }
-    // if cmd matches the regular expression go (.*)
-    if (toks[0] == "go") {
-      if (mdp.is_terminal(cur_node->state) && !mdp.actions(cur_node->state).empty()) {
-        best_move_str = select_randomly(g, mdp.actions(cur_node->state)); // FIXME: this is a big bug,
+    if (toks[0] == "go" && toks.size() >= 3 && toks[1] == "perft") {
+      // go perft N: count the move generator's leaf nodes from the current
+      // position, split by root move
+      auto pos = game;
+      auto start = std::chrono::steady_clock::now();
+      uint64_t nodes = 0;
+      for (auto& [move, count] : perft_divide<BitboardMoveGen>(pos, std::max(std::stoi(toks[2]), 1))) {
+        std::cout << move << ": " << count << std::endl;
+        nodes += count;
+      }
+      auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      std::cout << std::endl << "Nodes searched: " << nodes << std::endl;
+      std::cout << "info string perft nps " << (uint64_t)(nodes / std::max(seconds, 1e-9)) << std::endl;
+    } else if (toks[0] == "go") {
+      // if cmd matches the regular expression go (.*)
+      bool infinite = std::find(toks.begin(), toks.end(), "infinite") != toks.end();
+      pondering = std::find(toks.begin(), toks.end(), "ponder") != toks.end();
+      if (board_is_terminal(board) && !get_legal_moves(board).empty()) {
+        best_move_str = select_randomly(thread_rng(), get_legal_moves(board)).TerseOut(); // FIXME: this is a big bug,
+        std::cout << "bestmove " << best_move_str << std::endl;
+      } else if (infinite || pondering) {
+        ponder_go = toks;
+        start_search(SearchLimits(), !pondering);
       } else {
-        best_move_str = cur_node->par_search(800, 0.5, false);
+        start_search(go_limits(toks, board.white), true);
       }
-      std::cout << "bestmove " << best_move_str << std::endl;
     }
-
+    if (toks[0] == "ponderhit" && pondering) {
+      // the opponent played the expected move: keep the tree, search for real
+      // with the clock the `go ponder` came with, counted from now
+      finish_search(false);
+      start_search(go_limits(ponder_go, board.white), true);
+    }
     if (toks[0] == "stop") {
-      std::cout << "bestmove " << best_move_str << std::endl;
+      finish_search(true);
     }
     if (toks[0] == "quit") {
+      finish_search(false);
+      if (reaper.joinable()) {
+        reaper.join();
+      }
       // dump apprentice model to disk
       // if apprentice.pt already exists, delete it
       // if (std::filesystem::exists("apprentice.pt")) {
       //   std::filesystem::remove("apprentice.pt");
       // }
-      model.save("apprentice.pt");
+      backend.model.save("apprentice.pt");
       return 0;
     }
     if (toks[0] == "selfplay") {
       // perform toks[1] steps of self-play and use that to train the model
       int steps = std::stoi(toks[1]);
       std::cout << "Doing selfplay for " << steps << " steps" << std::endl;
+      tree_line = std::nullopt;
       bool over = false;
-      auto played = std::vector<std::string>();
+      auto played = std::vector<thc::Move>();
       auto num_turns = 0;
-      std::vector<thc::ChessRules> states;
-      std::vector<std::string> actions;
+      std::vector<bb::Position> states;
+      std::vector<thc::Move> actions;
 
       for (int num_turns = 0; num_turns < steps; num_turns += 1) {
         if (num_turns % 5 == 0) {
           std::cout << "Saving the current model." << std::endl;
-          model.save("apprentice.pt");
+          backend.model.save("apprentice.pt");
         }
         if (num_turns == 0 || over) {
           if (over) {
@@ -638,33 +1429,32 @@ int uci_chess() {
           }
 
           std::cout << "Starting new game" << std::endl;
-          states = std::vector<thc::ChessRules>();
+          states = std::vector<bb::Position>();
           board = thc::ChessRules();
-          root.reset(new ExItNode<thc::ChessRules, std::string>(mdp, apprentice, board, std::vector<ExItNode<thc::ChessRules, std::string>*>(), std::nullopt));
-          cur_node = root.get();
-          played = std::vector<std::string>();
+          game = bb::Position();
+          root = new_root();
+          cur_node = root;
+          played = std::vector<thc::Move>();
           display_position(board, "Initial position");
           over = false;
         }
-        states.push_back(board);
+        states.push_back(game);
         std::cout << "Step " << num_turns << std::endl;
         std::cout << "\tWins: " << wins << std::endl;
         std::cout << "\tLosses: " << losses << std::endl;
         std::cout << "\tStalemates/draws: " << stalemates << std::endl;
         if (num_turns > 0 && num_turns % 5 == 0) {
           std::cout << "\tClearing\n";
-          root.reset(new ExItNode<thc::ChessRules, std::string>(mdp, apprentice, thc::ChessRules(), std::vector<ExItNode<thc::ChessRules, std::string>*>(), std::nullopt));
+          root = new_root();
         }
 
         // play a move
-        cur_node = root.get()->play(played);
-        cur_node->state = board;
-        auto best_move_str = cur_node->par_search(800, 0.5, false);
-        actions.push_back(best_move_str);
-        thc::Move best_move;
-        best_move.TerseIn(&board, best_move_str.c_str());
+        cur_node = root->play(played);
+        auto best_move = run_search(cur_node, game);
+        actions.push_back(best_move);
         board.PushMove(best_move);
-        played.push_back(move_to_str(board, best_move));
+        game.play(bb::Position::from_thc(best_move));
+        played.push_back(best_move);
 
         std::cout << ((num_turns % 2 == 0) ? "White" : "Black") << " played: " << best_move.TerseOut() << std::endl;
         display_position(board, "");
@@ -679,7 +1469,7 @@ int uci_chess() {
           std::cout << "Black won!" << std::endl;
           wins += 1;
           over = true;
-        } else if (eval == thc::TERMINAL_WSTALEMATE || eval == thc::TERMINAL_BSTALEMATE || mdp.is_terminal(board) || (num_turns != 0 && num_turns % 50 == 0)) {
+        } else if (eval == thc::TERMINAL_WSTALEMATE || eval == thc::TERMINAL_BSTALEMATE || board_is_terminal(board) || (num_turns != 0 && num_turns % 50 == 0)) {
           std::cout << "Draw!" << std::endl;
           stalemates += 1;
           over = true;
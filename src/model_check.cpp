@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <torch/torch.h>
+#include <torch/script.h>
+#include "thc.h"
+#include "bitboard.h"
+#include "chess_support.h"
+#include "inference_queue.h"
+#include "model_backend.h"
+
+// Checks an exported network the way the engine uses it.
+//
+//   model_check [--model PATH] [--positions N]
+//
+// Loads the TorchScript module (apprentice.pt by default), evaluates N
+// positions from a random game one at a time and then together through the
+// InferenceQueue, and exits non-zero if the output isn't 4096 move
+// probabilities plus a value per position or if any row of the batch differs
+// from what its position gets on its own. Also reports whether the module
+// takes batches and how fast both ways are.
+
+constexpr int64_t output_width = 4096 + 1;
+
+// `n` positions along a random game from the start, restarting whenever it ends
+std::vector<bb::Position> sample_positions(int n) {
+  auto positions = std::vector<bb::Position>();
+  auto pos = bb::Position();
+  uint64_t seed = 1;
+  while ((int)positions.size() < n) {
+    positions.push_back(pos);
+    bb::MoveList list;
+    pos.legal_moves(list);
+    if (list.count == 0 || pos.is_draw()) {
+      pos = bb::Position();
+      continue;
+    }
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    pos.play(list.moves[(seed >> 33) % list.count]);
+  }
+  return positions;
+}
+
+int main(int argc, char** argv) {
+  std::string path = "apprentice.pt";
+  int n = 64;
+  for (int i = 1; i < argc; i++) {
+    if (!std::strcmp(argv[i], "--model") && i + 1 < argc) {
+      path = argv[++i];
+    } else if (!std::strcmp(argv[i], "--positions") && i + 1 < argc) {
+      n = std::max(std::stoi(argv[++i]), 2);
+    } else {
+      std::cerr << "usage: model_check [--model PATH] [--positions N]" << std::endl;
+      return 2;
+    }
+  }
+
+  torch::jit::script::Module model;
+  try {
+    model = torch::jit::load(path, torch::kCPU);
+  } catch (const c10::Error &error) {
+    std::cerr << "can't load " << path << ": " << error.what() << std::endl;
+    return 2;
+  }
+  ModelBackend backend(std::move(model), {board_planes, 8, 8});
+  std::cout << path << (backend.batched() ? " takes batches" : " takes one position at a time") << std::endl;
+
+  auto positions = sample_positions(n);
+  auto encoder = [](const bb::Position& pos) {
+    return [&pos](float* out) { encode_board(pos, out); };
+  };
+
+  // one at a time, straight through the backend
+  auto start = std::chrono::steady_clock::now();
+  auto singles = std::vector<torch::Tensor>();
+  for (auto& pos : positions) {
+    auto input = board_to_tensor(pos).view({1, board_planes, 8, 8});
+    auto output = backend.forward(input);
+    if (output.numel() != output_width) {
+      std::cout << "FAIL: output has " << output.numel() << " entries, expected " << output_width << std::endl;
+      return 1;
+    }
+    singles.push_back(output.view({-1}));
+  }
+  auto single_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // all together, the way the search's eval_many submits them
+  InferenceQueue inference([&backend](torch::Tensor batch) {
+    return backend.forward(batch);
+  }, {board_planes, 8, 8}, n, std::chrono::microseconds(100000), 1);
+  start = std::chrono::steady_clock::now();
+  auto pending = std::vector<std::future<torch::Tensor>>();
+  for (auto& pos : positions) {
+    pending.push_back(inference.submit(encoder(pos)));
+  }
+  auto rows = std::vector<torch::Tensor>();
+  try {
+    for (auto& result : pending) {
+      rows.push_back(inference.wait(result));
+    }
+  } catch (const c10::Error &error) {
+    std::cout << "FAIL: the batch threw: " << error.what() << std::endl;
+    return 1;
+  }
+  auto batch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  int mismatches = 0;
+  for (int i = 0; i < n; i++) {
+    if (rows[i].numel() != output_width || !torch::allclose(rows[i], singles[i], 1e-4, 1e-5)) {
+      mismatches++;
+    }
+  }
+  std::cout << "positions " << n << " one at a time " << (long)(n / std::max(single_seconds, 1e-9)) << "/s"
+            << " batched " << (long)(n / std::max(batch_seconds, 1e-9)) << "/s" << std::endl;
+  if (mismatches > 0) {
+    std::cout << "FAIL: " << mismatches << " of " << n << " batch rows differ from the position on its own" << std::endl;
+    return 1;
+  }
+  std::cout << "ok" << std::endl;
+  return 0;
+}
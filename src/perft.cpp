@@ -0,0 +1,69 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include "thc.h"
+#include "bitboard.h"
+#include "perft.h"
+
+// Move generator benchmark and correctness check.
+//
+//   perft [--gen bitboard|thc] [--depth N] [--fen FEN] [--divide] [--no-bulk]
+//
+// Without --fen it runs the standard suite to --depth (default 5) and exits
+// non-zero if any count is off. With --fen it counts that position, split by
+// root move with --divide.
+
+template<typename Gen>
+int run(std::optional<std::string> fen, int depth, bool divide, bool bulk) {
+  if (!fen.has_value()) {
+    return run_perft_suite<Gen>(depth, bulk, std::cout) ? 0 : 1;
+  }
+  auto pos = Gen::from_fen(*fen);
+  auto start = std::chrono::steady_clock::now();
+  uint64_t nodes = 0;
+  if (divide) {
+    for (auto& [move, count] : perft_divide<Gen>(pos, depth, bulk)) {
+      std::cout << move << ": " << count << std::endl;
+      nodes += count;
+    }
+  } else {
+    nodes = perft<Gen>(pos, depth, bulk);
+  }
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "nodes " << nodes << " time " << (long)(seconds * 1000) << "ms nps " << (uint64_t)(nodes / std::max(seconds, 1e-9)) << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  std::string gen = "bitboard";
+  std::optional<std::string> fen;
+  int depth = 5;
+  bool divide = false;
+  bool bulk = true;
+  for (int i = 1; i < argc; i++) {
+    if (!std::strcmp(argv[i], "--gen") && i + 1 < argc) {
+      gen = argv[++i];
+    } else if (!std::strcmp(argv[i], "--depth") && i + 1 < argc) {
+      depth = std::max(std::stoi(argv[++i]), 1);
+    } else if (!std::strcmp(argv[i], "--fen") && i + 1 < argc) {
+      fen = argv[++i];
+    } else if (!std::strcmp(argv[i], "--divide")) {
+      divide = true;
+    } else if (!std::strcmp(argv[i], "--no-bulk")) {
+      bulk = false;
+    } else {
+      std::cerr << "usage: perft [--gen bitboard|thc] [--depth N] [--fen FEN] [--divide] [--no-bulk]" << std::endl;
+      return 2;
+    }
+  }
+  if (gen == "thc") {
+    return run<ThcMoveGen>(fen, depth, divide, bulk);
+  }
+  if (gen == "bitboard") {
+    return run<BitboardMoveGen>(fen, depth, divide, bulk);
+  }
+  std::cerr << "unknown move generator: " << gen << std::endl;
+  return 2;
+}
@@ -24,9 +24,9 @@ class Forked(Module):
 
     def forward(self, x):
         thru_parent = self.parent(x)
-        # FIXME: these reshapes are valid when we have effectively one-dim'l
-        # tensors, but i'm not sure it makes sense in the general case.
-        return torch.concat([self.left(thru_parent).reshape(-1), self.right(thru_parent).reshape(-1)])
+        # one row per position in the batch: its 4096 move probabilities, then
+        # its value
+        return torch.concat([self.left(thru_parent), self.right(thru_parent)], dim=1)
 
 def pre_block():
     return Sequential(
@@ -52,11 +52,11 @@ def policy_head():
           Conv2d(in_channels=256, out_channels=2, kernel_size=1, stride=1)
         , BatchNorm2d(2)
         , ReLU()
-        , Flatten(0,-1)
+        , Flatten(1,-1)
         , Linear(2*8*8, 64**2) # 64**2 outputs, ~> not all of these are legal
                                # moves; e.g. everything along the diagonal is an
                                # illegal "pass" move.
-        , Softmax(dim=0)
+        , Softmax(dim=1)
     )
 
 def value_head():
@@ -64,7 +64,7 @@ def value_head():
           Conv2d(in_channels=256, out_channels=1, kernel_size=1, stride=1)
         , BatchNorm2d(1)
         , ReLU()
-        , Flatten(0,-1) # , Reshaper([-1,8*8])
+        , Flatten(1,-1) # , Reshaper([-1,8*8])
         , Linear(8*8, 256)
         , ReLU()
         , Linear(256, 1)
@@ -76,6 +76,19 @@ alpha_net = Forked(parent = Sequential(*([pre_block()] + [res_block()]*39)),
                    left = policy_head(),
                    right = value_head())
 
-example_board = torch.randn(1,119,8,8)
-traced_model = torch.jit.trace(alpha_net, example_board)
+# traced with a batch of more than one position, so nothing in the trace
+# assumes batch 1; the engine sends it batches of any size
+example_boards = torch.randn(2,119,8,8)
+traced_model = torch.jit.trace(alpha_net, example_boards)
 traced_model.save("alphanet.pt")
+
+# check the exported module: every row of a batch must be what the position
+# gets on its own (in eval mode, so batch norm doesn't mix the rows)
+exported = torch.jit.load("alphanet.pt")
+exported.eval()
+with torch.no_grad():
+    boards = torch.randn(3,119,8,8)
+    batched = exported(boards)
+    assert batched.shape == (3, 64**2 + 1), batched.shape
+    for i in range(boards.shape[0]):
+        assert torch.allclose(batched[i], exported(boards[i:i+1])[0], atol=1e-5), i